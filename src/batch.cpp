@@ -0,0 +1,149 @@
+//
+// Runs lanes of the same game in lockstep, each with its own key presses
+//
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "chip8_batch.h"
+#include "chip8_rom.h"
+
+// Key presses of each lane, they differ so the lanes do not all take the same branches
+void setLaneKeys(unsigned char *key, unsigned int lane, unsigned long long frame, bool sameKeys) {
+    memset(key, 0, 16);
+
+    if (sameKeys)
+        lane = 0;
+
+    if (((frame / 30 + lane) & 1) != 0)
+        key[(frame / 30 + lane * 5) % 16] = 1;
+}
+
+void usage() {
+    printf("Usage: chip8-batch chip8application [options]\n"
+           "\n"
+           "  --frames N            Frames to run (default 600)\n"
+           "  --batches N           Batches of %d lanes to run one after the other (default 1)\n"
+           "  --cycles-per-frame N  Instructions per frame (default %d)\n"
+           "  --clip                Cuts sprites at the edges of the screen instead of wrapping them around\n"
+           "  --same-keys           Presses the same keys in every lane, they only diverge on random numbers\n"
+           "  --check               Runs a chip8 next to each lane and compares them after every frame\n"
+           "  --seed N              Seed of the random numbers, lane l of batch b uses N + b * %d + l (default %d)\n"
+           "\n", CHIP_8_BATCH_LANES, CHIP_8_CYCLES_PER_FRAME, CHIP_8_BATCH_LANES,
+           CHIP_8_RANDOM_SEED);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    unsigned long long frames = 600;
+    unsigned int batches = 1;
+    unsigned int cyclesPerFrame = CHIP_8_CYCLES_PER_FRAME;
+    bool clip = false;
+    bool check = false;
+    bool sameKeys = false;
+    unsigned long long seed = CHIP_8_RANDOM_SEED;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--batches") == 0 && i + 1 < argc)
+            batches = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cycles-per-frame") == 0 && i + 1 < argc)
+            cyclesPerFrame = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--clip") == 0)
+            clip = true;
+        else if (strcmp(argv[i], "--same-keys") == 0)
+            sameKeys = true;
+        else if (strcmp(argv[i], "--check") == 0)
+            check = true;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    // The batch and the reference instances all load the game from one mapping of the file
+    chip8Rom rom;
+    chip8LoadError error = rom.open(argv[1]);
+    if (error != CHIP_8_LOAD_OK) {
+        fprintf(stderr, "Cannot load %s: %s\n", argv[1], chip8LoadErrorString(error));
+        return 1;
+    }
+
+    auto batch = std::make_unique<chip8Batch>();
+    std::vector<std::unique_ptr<chip8>> references;
+
+    double seconds = 0;
+
+    for (unsigned int b = 0; b < batches; b++) {
+        batch->initialize();
+        batch->loadGame(rom.bytes());
+        batch->cyclesPerFrame = cyclesPerFrame;
+        batch->clipSprites = clip;
+        batch->seedRandom(seed + (unsigned long long) b * CHIP_8_BATCH_LANES);
+
+        if (check) {
+            references.clear();
+            for (unsigned int l = 0; l < CHIP_8_BATCH_LANES; l++) {
+                references.push_back(std::make_unique<chip8>());
+                references[l]->initialize();
+                references[l]->loadGame(rom.bytes());
+                references[l]->soundEnabled = false;
+                references[l]->clipSprites = clip;
+                references[l]->seedRandom(seed + (unsigned long long) b * CHIP_8_BATCH_LANES + l);
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (unsigned long long frame = 0; frame < frames; frame++) {
+            for (unsigned int l = 0; l < CHIP_8_BATCH_LANES; l++)
+                setLaneKeys(batch->key[l], l, frame, sameKeys);
+
+            if (!check) {
+                batch->runFrames(1);
+                continue;
+            }
+
+            for (unsigned int l = 0; l < CHIP_8_BATCH_LANES; l++)
+                memcpy(references[l]->key, batch->key[l], 16);
+
+            for (unsigned int i = 0; i < cyclesPerFrame; i++) {
+                batch->step();
+                for (unsigned int l = 0; l < CHIP_8_BATCH_LANES; l++)
+                    references[l]->emulateCycle();
+            }
+
+            batch->tickTimers();
+            for (unsigned int l = 0; l < CHIP_8_BATCH_LANES; l++)
+                references[l]->tickTimers();
+
+            for (unsigned int l = 0; l < CHIP_8_BATCH_LANES; l++) {
+                if (!batch->matches(l, *references[l])) {
+                    printf("lane %u differs from chip8 at frame %llu of batch %u\n", l, frame, b);
+                    return 1;
+                }
+            }
+        }
+
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    unsigned long long instructions = (unsigned long long) batches * frames * cyclesPerFrame * CHIP_8_BATCH_LANES;
+
+    printf("lanes %d batches %u frames %llu instructions %llu time %.3f s (%.1f million instructions/s)\n",
+           CHIP_8_BATCH_LANES, batches, frames, instructions, seconds, instructions / seconds / 1e6);
+    batch->printStats(stdout);
+    if (check)
+        printf("every lane matches chip8\n");
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+//
+// Measures the speed of the interpreter on the games and on synthetic mixes of one class of opcodes each
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_rom.h"
+
+#ifndef CHIP_8_GAMES_DIR
+#define CHIP_8_GAMES_DIR "games"
+#endif
+
+#if defined(CHIP_8_DISPATCH_THREADED)
+#define CHIP_8_DISPATCH_NAME "THREADED"
+#elif defined(CHIP_8_DISPATCH_TABLE)
+#define CHIP_8_DISPATCH_NAME "TABLE"
+#else
+#define CHIP_8_DISPATCH_NAME "SWITCH"
+#endif
+
+#ifdef CHIP_8_JIT
+#define CHIP_8_JIT_ENABLED true
+#else
+#define CHIP_8_JIT_ENABLED false
+#endif
+
+// Endless loop mostly made of one class of opcodes
+struct syntheticRom {
+    const char *name;
+    const char *opcodes;
+    std::vector<unsigned short> program;
+};
+
+static std::vector<syntheticRom> syntheticRoms() {
+    return {
+            // 6XNN, 7XNN and the 8XY* arithmetic and logic
+            {"alu", "6XNN 7XNN 8XY*", {
+                    0x6001, 0x6102, 0x8014, 0x8125, 0x8202, 0x8313, 0x8406, 0x7105, 0x8530, 0x8651,
+                    0x870E, 0x8E74, 0x8F01, 0x7A03, 0x8BA5, 0x1200}},
+            // A counted loop of 3XNN and 4XNN skips and jumps
+            {"branch", "3XNN 4XNN 5XY0 9XY0 1NNN", {
+                    0x6000, 0x6100, 0x7001, 0x3005, 0x1204, 0x4000, 0x1200, 0x5010, 0x9010, 0x6200, 0x1200}},
+            // Calls and returns
+            {"call", "2NNN 00EE", {
+                    0x220A, 0x220A, 0x220C, 0x220A, 0x1200, 0x00EE, 0x220A, 0x00EE}},
+            // BCD, register dumps and loads, I arithmetic
+            {"memory", "ANNN FX33 FX55 FX65 FX1E", {
+                    0xA300, 0x6A7B, 0xFA33, 0xF355, 0xF365, 0xFA1E, 0xF333, 0xF465, 0x1200}},
+            // Sprites drawn across the screen, cleared every loop
+            {"draw", "00E0 DXYN", {
+                    0x00E0, 0xA000, 0x6000, 0x6100, 0xD015, 0x7008, 0x7103, 0xD015, 0x7008, 0xD01F, 0x1200}},
+            // Timers, font and random numbers
+            {"misc", "FX15 FX07 FX18 FX29 CXNN", {
+                    0x6010, 0xF015, 0xF107, 0xF018, 0xC2FF, 0xF229, 0xC30F, 0xF307, 0x1200}},
+    };
+}
+
+// A game or a synthetic ROM to measure
+struct benchmark {
+    std::string name;
+    std::string kind;
+    std::string opcodes;
+    std::vector<unsigned char> rom;
+};
+
+// Time of each repetition, and what it ran
+struct measurement {
+    std::vector<double> nanosecondsPerInstruction;
+    std::vector<double> framesPerSecond;
+    unsigned long long instructions = 0;
+    unsigned long long frames = 0;
+    // Times a game stopped on an unknown opcode and was started again
+    unsigned long long restarts = 0;
+};
+
+// Value at a percentile of sorted values, nearest rank
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+
+    size_t rank = (size_t) (p / 100 * sorted.size() + 0.999999);
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+static double median(const std::vector<double> &sorted) {
+    return percentile(sorted, 50);
+}
+
+static void startGame(chip8 &c, const benchmark &b, unsigned int cyclesPerFrame) {
+    c.initialize();
+    c.loadGame(b.rom);
+    memset(c.key, 0, sizeof(c.key));
+    c.cyclesPerFrame = cyclesPerFrame;
+    c.soundEnabled = false;
+}
+
+// Runs a game from its start until it executed at least count instructions, pressing a key now and then so that the
+// games waiting for one carry on, and starting it again if it stops on an unknown opcode
+static void runOnce(chip8 &c, const benchmark &b, unsigned long long count, unsigned int cyclesPerFrame,
+                    measurement &m, bool keep) {
+    startGame(c, b, cyclesPerFrame);
+
+    unsigned long long executed = 0;
+    unsigned long long frames = 0;
+    unsigned long long restarts = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (executed < count) {
+        memset(c.key, 0, sizeof(c.key));
+        if ((frames / 30) % 2 == 1)
+            c.key[(frames / 60) % 16] = 1;
+
+        chip8RunResult result = c.runFrames(30);
+        executed += result.cycles;
+        frames += result.frames;
+
+        if (result.reason == CHIP_8_STOP_ILLEGAL) {
+            startGame(c, b, cyclesPerFrame);
+            restarts++;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!keep)
+        return;
+
+    m.nanosecondsPerInstruction.push_back(executed ? seconds * 1e9 / executed : 0.0);
+    m.framesPerSecond.push_back(seconds > 0 ? frames / seconds : 0.0);
+    m.instructions = executed;
+    m.frames = frames;
+    m.restarts = restarts;
+}
+
+// A string as a quoted JSON string, with its quotes, backslashes and control characters escaped
+static std::string jsonString(const std::string &text) {
+    std::string quoted = "\"";
+
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += (char) c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else
+            quoted += (char) c;
+    }
+
+    return quoted + "\"";
+}
+
+static void printJson(FILE *out, const std::vector<benchmark> &benchmarks, const std::vector<measurement> &results,
+                      unsigned long long instructions, unsigned int warmup, unsigned int repetitions,
+                      unsigned int cyclesPerFrame) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"dispatch\": \"%s\",\n", CHIP_8_DISPATCH_NAME);
+    fprintf(out, "  \"jit\": %s,\n", CHIP_8_JIT_ENABLED ? "true" : "false");
+    fprintf(out, "  \"instructions\": %llu,\n", instructions);
+    fprintf(out, "  \"warmup\": %u,\n", warmup);
+    fprintf(out, "  \"repetitions\": %u,\n", repetitions);
+    fprintf(out, "  \"cycles_per_frame\": %u,\n", cyclesPerFrame);
+    fprintf(out, "  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < benchmarks.size(); i++) {
+        const benchmark &b = benchmarks[i];
+        const measurement &m = results[i];
+        double ns = median(m.nanosecondsPerInstruction);
+
+        fprintf(out, "    {\n");
+        fprintf(out, "      \"name\": %s,\n", jsonString(b.name).c_str());
+        fprintf(out, "      \"kind\": %s,\n", jsonString(b.kind).c_str());
+        fprintf(out, "      \"opcodes\": %s,\n", jsonString(b.opcodes).c_str());
+        fprintf(out, "      \"instructions\": %llu,\n", m.instructions);
+        fprintf(out, "      \"frames\": %llu,\n", m.frames);
+        fprintf(out, "      \"restarts\": %llu,\n", m.restarts);
+        fprintf(out, "      \"ns_per_instruction\": {\"median\": %.3f, \"p99\": %.3f, \"min\": %.3f, \"max\": %.3f},\n",
+                ns, percentile(m.nanosecondsPerInstruction, 99), m.nanosecondsPerInstruction.front(),
+                m.nanosecondsPerInstruction.back());
+        fprintf(out, "      \"instructions_per_second\": {\"median\": %.0f},\n", ns > 0 ? 1e9 / ns : 0.0);
+        fprintf(out, "      \"frames_per_second\": {\"median\": %.0f, \"p1\": %.0f}\n", median(m.framesPerSecond),
+                percentile(m.framesPerSecond, 1));
+        fprintf(out, "    }%s\n", i + 1 < benchmarks.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+void usage() {
+    printf("Usage: chip8-bench [options] [game.c8 ...]\n"
+           "\n"
+           "Runs each game, every file of the games directory when none is given, and synthetic ROMs each made of one\n"
+           "class of opcodes, without a window. The synthetic ROMs give the time per instruction of each class.\n"
+           "\n"
+           "  --games DIR           Directory of the games (default %s)\n"
+           "  --instructions N      Instructions per repetition (default 10000000)\n"
+           "  --warmup N            Repetitions run first and not measured (default 2)\n"
+           "  --repetitions N       Measured repetitions (default 10)\n"
+           "  --cycles-per-frame N  Instructions per frame (default %d)\n"
+           "  --no-games            Only runs the synthetic ROMs\n"
+           "  --no-synthetic        Only runs the games\n"
+           "  --json FILE           Writes the results as JSON, - for the standard output\n"
+           "\n", CHIP_8_GAMES_DIR, CHIP_8_CYCLES_PER_FRAME);
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> games;
+    std::string gamesDirectory = CHIP_8_GAMES_DIR;
+    unsigned long long instructions = 10000000;
+    unsigned int warmup = 2;
+    unsigned int repetitions = 10;
+    unsigned int cyclesPerFrame = CHIP_8_CYCLES_PER_FRAME;
+    bool runGames = true;
+    bool runSynthetic = true;
+    const char *jsonPath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--games") == 0 && i + 1 < argc)
+            gamesDirectory = argv[++i];
+        else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc)
+            instructions = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+            warmup = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc)
+            repetitions = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cycles-per-frame") == 0 && i + 1 < argc)
+            cyclesPerFrame = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--no-games") == 0)
+            runGames = false;
+        else if (strcmp(argv[i], "--no-synthetic") == 0)
+            runSynthetic = false;
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (argv[i][0] != '-')
+            games.push_back(argv[i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (repetitions == 0 || instructions == 0 || cyclesPerFrame == 0) {
+        usage();
+        return 1;
+    }
+
+    if (runGames && games.empty()) {
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(gamesDirectory, error)) {
+            if (entry.is_regular_file())
+                games.push_back(entry.path().string());
+        }
+        std::sort(games.begin(), games.end());
+    }
+
+    std::vector<benchmark> benchmarks;
+
+    if (runGames) {
+        for (const std::string &path : games) {
+            chip8Rom rom;
+            chip8LoadError error = rom.open(path.c_str());
+            if (error != CHIP_8_LOAD_OK) {
+                fprintf(stderr, "Cannot load %s: %s\n", path.c_str(), chip8LoadErrorString(error));
+                return 1;
+            }
+
+            std::span<const unsigned char> bytes = rom.bytes();
+            benchmarks.push_back({std::filesystem::path(path).filename().string(), "game", "",
+                                  std::vector<unsigned char>(bytes.begin(), bytes.end())});
+        }
+    }
+
+    if (runSynthetic) {
+        for (const syntheticRom &s : syntheticRoms()) {
+            benchmark b = {s.name, "synthetic", s.opcodes, {}};
+            for (unsigned short opcode : s.program) {
+                b.rom.push_back(opcode >> 8);
+                b.rom.push_back(opcode & 0xFF);
+            }
+            benchmarks.push_back(b);
+        }
+    }
+
+    if (benchmarks.empty()) {
+        fprintf(stderr, "Nothing to run, no game found in %s\n", gamesDirectory.c_str());
+        return 1;
+    }
+
+    auto c = std::make_unique<chip8>();
+    std::vector<measurement> results(benchmarks.size());
+
+    // The table goes to the standard error when the JSON goes to the standard output
+    FILE *table = jsonPath && strcmp(jsonPath, "-") == 0 ? stderr : stdout;
+
+    fprintf(table, "dispatch %s%s, %llu instructions x %u repetitions after %u warm-up\n\n", CHIP_8_DISPATCH_NAME,
+            CHIP_8_JIT_ENABLED ? " + JIT" : "", instructions, repetitions, warmup);
+    fprintf(table, "%-16s %-10s %12s %12s %12s %16s %14s\n", "name", "kind", "ns/ins med", "ns/ins p99", "ns/ins min",
+            "M ins/s med", "frames/s med");
+
+    for (size_t i = 0; i < benchmarks.size(); i++) {
+        for (unsigned int r = 0; r < warmup; r++)
+            runOnce(*c, benchmarks[i], instructions, cyclesPerFrame, results[i], false);
+        for (unsigned int r = 0; r < repetitions; r++)
+            runOnce(*c, benchmarks[i], instructions, cyclesPerFrame, results[i], true);
+
+        measurement &m = results[i];
+        std::sort(m.nanosecondsPerInstruction.begin(), m.nanosecondsPerInstruction.end());
+        std::sort(m.framesPerSecond.begin(), m.framesPerSecond.end());
+
+        double ns = median(m.nanosecondsPerInstruction);
+        fprintf(table, "%-16s %-10s %12.2f %12.2f %12.2f %16.1f %14.0f", benchmarks[i].name.c_str(),
+                benchmarks[i].kind.c_str(), ns, percentile(m.nanosecondsPerInstruction, 99),
+                m.nanosecondsPerInstruction.front(), ns > 0 ? 1e3 / ns : 0.0, median(m.framesPerSecond));
+        if (m.restarts > 0)
+            fprintf(table, "  (restarted %llu times after an unknown opcode)", m.restarts);
+        fprintf(table, "\n");
+    }
+
+    if (jsonPath) {
+        FILE *out = strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot write %s\n", jsonPath);
+            return 1;
+        }
+
+        printJson(out, benchmarks, results, instructions, warmup, repetitions, cyclesPerFrame);
+        if (out != stdout)
+            fclose(out);
+    }
+
+    return 0;
+}
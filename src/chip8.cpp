@@ -2,7 +2,15 @@
 // Created by chokearth on 09/07/2021.
 //
 
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "chip8.h"
+#include "chip8_rom.h"
 
 unsigned char chip8_fontset[80] =
         {
@@ -26,7 +34,6 @@ unsigned char chip8_fontset[80] =
 
 void chip8::initialize() {
     pc = 0x200;
-    opcode = 0;
     I = 0;
     sp = 0;
 
@@ -38,274 +45,1081 @@ void chip8::initialize() {
     // Clear registers
     memset(V, 0, CHIP_8_REGISTER);
     // Clear display
-    memset(gfx, 0, CHIP_8_SCREEN_WIDTH * CHIP_8_SCREEN_HEIGHT);
+    memset(gfx, 0, sizeof(gfx));
+    dirtyRows = 0xFFFFFFFF;
     // Clear stack
     memset(stack, 0, CHIP_8_STACK);
 
     // Load font
     memcpy(memory, chip8_fontset, 80);
+    // Forget decoded instructions
+    memset(decoded, 0, sizeof(decoded));
+#ifdef CHIP_8_JIT
+    if (!jit)
+        jit = std::make_unique<chip8Jit>();
+    jit->flush();
+#endif
 
     drawFlag = true;
+    waitingForKey = false;
+
+    cycles = 0;
+    cycleTarget = 0;
+    frameCycles = 0;
+    idleCycles = 0;
+    keyReads = 0;
+    timeKeyRead = false;
+    memset(fusionHits, 0, sizeof(fusionHits));
+    profile.clear();
+    trace.clear();
 
-    srand(time(NULL));
+    seedRandom(CHIP_8_RANDOM_SEED);
 }
 
-void chip8::loadGame(const char *gamePath) {
-    FILE *gameFile = fopen(gamePath, "rb");
+void chip8::seedRandom(uint64_t seed) {
+    randomState = chip8RandomState(seed);
+}
 
-    if (gameFile) {
+const char *chip8LoadErrorString(chip8LoadError error) {
+    switch (error) {
+        case CHIP_8_LOAD_OK: return "loaded";
+        case CHIP_8_LOAD_CANNOT_OPEN: return "cannot open the file";
+        case CHIP_8_LOAD_CANNOT_READ: return "cannot read the file";
+        case CHIP_8_LOAD_EMPTY: return "the game is empty";
+        case CHIP_8_LOAD_TOO_LARGE: return "the game is larger than the 3584 bytes from 0x200 to the end of the memory";
+    }
 
-        fseek(gameFile, 0, SEEK_END);
-        long lSize = ftell(gameFile);
-        rewind(gameFile);
+    return "unknown error";
+}
 
-        char *buffer = (char *) malloc(sizeof(char) * lSize);
-        fread(buffer, 1, lSize, gameFile);
+chip8LoadError chip8::loadGame(std::span<const unsigned char> game) {
+    if (game.empty())
+        return CHIP_8_LOAD_EMPTY;
+    if (game.size() > CHIP_8_MAX_GAME_SIZE)
+        return CHIP_8_LOAD_TOO_LARGE;
 
-        if ((CHIP_8_MEMORY - 512) > lSize) {
-            for (int i = 0; i < lSize; i++) {
-                memory[i + 512] = buffer[i];
-            }
-        }
+    memcpy(memory + CHIP_8_PROGRAM_START, game.data(), game.size());
+    predecode(CHIP_8_PROGRAM_START, CHIP_8_PROGRAM_START + game.size());
+#ifdef CHIP_8_JIT
+    jit->flush();
+#endif
+
+    return CHIP_8_LOAD_OK;
+}
+
+chip8LoadError chip8::loadGame(const char *gamePath) {
+    chip8Rom rom;
+
+    chip8LoadError error = rom.open(gamePath);
+    if (error != CHIP_8_LOAD_OK)
+        return error;
+
+    return loadGame(rom.bytes());
+}
+
+void chip8::snapshot(chip8State &state) const {
+    state.magic = CHIP_8_STATE_MAGIC;
+    state.version = CHIP_8_STATE_VERSION;
+
+    memcpy(state.gfx, gfx, sizeof(gfx));
+    state.randomState = randomState;
+    state.cycles = cycles;
+    state.frameCycles = frameCycles;
+
+    memcpy(state.stack, stack, sizeof(stack));
+    state.I = I;
+    state.pc = pc;
+    state.sp = sp;
+
+    memcpy(state.V, V, sizeof(V));
+    state.delay_timer = delay_timer;
+    state.sound_timer = sound_timer;
+    memcpy(state.key, key, sizeof(key));
+    state.waitingForKey = waitingForKey;
+    memset(state.reserved, 0, sizeof(state.reserved));
+
+    memcpy(state.memory, memory, sizeof(memory));
+}
+
+bool chip8::restore(const chip8State &state) {
+    if (state.magic != CHIP_8_STATE_MAGIC || state.version != CHIP_8_STATE_VERSION)
+        return false;
+    // States come from files too, a stack pointer past the stack or a frame already over would run out of bounds
+    if (state.sp > CHIP_8_STACK || state.frameCycles > cyclesPerFrame)
+        return false;
+
+    // Usually only data changed since the snapshot, the decoded instructions are only dropped where memory differs
+    for (int address = 0; address < CHIP_8_MEMORY; address += 64) {
+        if (memcmp(memory + address, state.memory + address, 64) != 0)
+            invalidateCode(address, 64);
+    }
+    memcpy(memory, state.memory, sizeof(memory));
+
+    memcpy(gfx, state.gfx, sizeof(gfx));
+    dirtyRows = 0xFFFFFFFF;
+    drawFlag = true;
+    randomState = state.randomState;
+    cycles = state.cycles;
+    frameCycles = state.frameCycles;
+
+    memcpy(stack, state.stack, sizeof(stack));
+    I = state.I & (CHIP_8_MEMORY - 1);
+    pc = state.pc & (CHIP_8_MEMORY - 1);
+    sp = state.sp;
+
+    memcpy(V, state.V, sizeof(V));
+    delay_timer = state.delay_timer;
+    sound_timer = state.sound_timer;
+    memcpy(key, state.key, sizeof(key));
+    waitingForKey = state.waitingForKey != 0;
+
+    return true;
+}
+
+bool chip8::saveState(const char *path) const {
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    chip8State state;
+    snapshot(state);
+
+    bool written = fwrite(&state, sizeof(state), 1, file) == 1;
+    return fclose(file) == 0 && written;
+}
+
+bool chip8::loadState(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    chip8State state;
+    bool read = fread(&state, sizeof(state), 1, file) == 1;
+    fclose(file);
+
+    return read && restore(state);
+}
+
+// Builds the opcode -> handler id table, indexed by the top nibble and the sub-op of each group
+static constexpr auto buildOpTable() {
+    struct {
+        unsigned char ops[16][256];
+    } table{};
+
+    for (int low = 0; low < 256; low++) {
+        table.ops[0x0][low] = OP_ILLEGAL;
+        table.ops[0x1][low] = OP_1NNN;
+        table.ops[0x2][low] = OP_2NNN;
+        table.ops[0x3][low] = OP_3XNN;
+        table.ops[0x4][low] = OP_4XNN;
+        table.ops[0x5][low] = OP_5XY0;
+        table.ops[0x6][low] = OP_6XNN;
+        table.ops[0x7][low] = OP_7XNN;
+        table.ops[0x9][low] = OP_9XY0;
+        table.ops[0xA][low] = OP_ANNN;
+        table.ops[0xB][low] = OP_BNNN;
+        table.ops[0xC][low] = OP_CXNN;
+        table.ops[0xD][low] = OP_DXYN;
+        table.ops[0xE][low] = OP_ILLEGAL;
+        table.ops[0xF][low] = OP_ILLEGAL;
+
+        // 0x8XY? groups on the low nibble only
+        constexpr unsigned char alu[16] = {
+                OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6, OP_8XY7,
+                OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_ILLEGAL, OP_8XYE, OP_ILLEGAL
+        };
+        table.ops[0x8][low] = alu[low & 0xF];
+    }
+
+    table.ops[0x0][0xE0] = OP_00E0;
+    table.ops[0x0][0xEE] = OP_00EE;
+
+    table.ops[0xE][0x9E] = OP_EX9E;
+    table.ops[0xE][0xA1] = OP_EXA1;
+
+    table.ops[0xF][0x07] = OP_FX07;
+    table.ops[0xF][0x0A] = OP_FX0A;
+    table.ops[0xF][0x15] = OP_FX15;
+    table.ops[0xF][0x18] = OP_FX18;
+    table.ops[0xF][0x1E] = OP_FX1E;
+    table.ops[0xF][0x29] = OP_FX29;
+    table.ops[0xF][0x33] = OP_FX33;
+    table.ops[0xF][0x55] = OP_FX55;
+    table.ops[0xF][0x65] = OP_FX65;
+
+    return table;
+}
+
+static constexpr auto opTable = buildOpTable();
+
+struct chip8Dispatch {
+    typedef void (chip8::*handler)(const chip8Instruction &ins);
+
+    static constexpr handler handlers[OP_COUNT] = {
+#define CHIP_8_OP_HANDLER(name) &chip8::op##name,
+            CHIP_8_ALL_OPCODES(CHIP_8_OP_HANDLER)
+#undef CHIP_8_OP_HANDLER
+    };
+};
+
+static constexpr auto buildFlagTable() {
+    struct {
+        unsigned char flags[OP_COUNT];
+    } table{};
+
+    table.flags[OP_00E0] = CHIP_8_INSTRUCTION_DRAW;
+    table.flags[OP_00EE] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_1NNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_2NNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_3XNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_4XNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_5XY0] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_9XY0] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_BNNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_DXYN] = CHIP_8_INSTRUCTION_DRAW;
+    table.flags[OP_EX9E] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_EXA1] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_FX0A] = CHIP_8_INSTRUCTION_WAIT;
+    table.flags[OP_FX33] = CHIP_8_INSTRUCTION_WRITE;
+    table.flags[OP_FX55] = CHIP_8_INSTRUCTION_WRITE;
+    // An unknown opcode never moves pc
+    table.flags[OP_ILLEGAL] = CHIP_8_INSTRUCTION_BRANCH;
+
+    // A superinstruction does what both its instructions do
+    table.flags[OP_6XNN_6XNN] = 0;
+    table.flags[OP_ANNN_DXYN] = CHIP_8_INSTRUCTION_DRAW;
+    table.flags[OP_3XNN_1NNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_4XNN_1NNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_7XNN_3XNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_7XNN_4XNN] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_IDLE_JUMP] = CHIP_8_INSTRUCTION_BRANCH;
+    table.flags[OP_IDLE_DELAY] = CHIP_8_INSTRUCTION_BRANCH;
+
+    return table;
+}
+
+// Superinstruction running the pair first, second, or the first one alone
+static constexpr auto buildFusionTable() {
+    struct {
+        unsigned char ops[OP_FIRST_FUSED][OP_FIRST_FUSED];
+    } table{};
+
+    for (int first = 0; first < OP_FIRST_FUSED; first++)
+        for (int second = 0; second < OP_FIRST_FUSED; second++)
+            table.ops[first][second] = first;
+
+    table.ops[OP_6XNN][OP_6XNN] = OP_6XNN_6XNN;
+    table.ops[OP_ANNN][OP_DXYN] = OP_ANNN_DXYN;
+    table.ops[OP_3XNN][OP_1NNN] = OP_3XNN_1NNN;
+    table.ops[OP_4XNN][OP_1NNN] = OP_4XNN_1NNN;
+    table.ops[OP_7XNN][OP_3XNN] = OP_7XNN_3XNN;
+    table.ops[OP_7XNN][OP_4XNN] = OP_7XNN_4XNN;
+
+    return table;
+}
+
+static constexpr auto fusionTable = buildFusionTable();
+
+static const char *opNames[OP_COUNT] = {
+#define CHIP_8_OP_NAME(name) #name,
+        CHIP_8_ALL_OPCODES(CHIP_8_OP_NAME)
+#undef CHIP_8_OP_NAME
+};
+
+static constexpr auto flagTable = buildFlagTable();
 
+static inline chip8Instruction decode(unsigned short opcode) {
+    chip8Instruction ins;
+
+    ins.opcode = opcode;
+    ins.NNN = opcode & 0x0FFF;
+    ins.X = (opcode & 0x0F00) >> 8;
+    ins.Y = (opcode & 0x00F0) >> 4;
+    ins.N = opcode & 0x000F;
+    ins.NN = opcode & 0x00FF;
+
+    ins.op = opTable.ops[opcode >> 12][opcode & 0x00FF];
+    // 0x0NNN machine code routines are not supported
+    if ((opcode & 0xFF00) != 0 && (opcode & 0xF000) == 0)
+        ins.op = OP_ILLEGAL;
+
+    ins.base = ins.op;
+    ins.flags = CHIP_8_INSTRUCTION_DECODED | flagTable.flags[ins.op];
+
+    return ins;
+}
+
+void chip8::predecode(unsigned short start, unsigned short end) {
+    for (unsigned short address = start; address < end && address < CHIP_8_MEMORY; address++) {
+        chip8Instruction &ins = decoded[address];
+        ins = decode(memory[address] << 8 | memory[(address + 1) & (CHIP_8_MEMORY - 1)]);
+
+        // Fuse with the instruction that follows, except in a trace which records each instruction on its own
+        chip8Instruction next = decode(memory[(address + 2) & (CHIP_8_MEMORY - 1)] << 8 |
+                                       memory[(address + 3) & (CHIP_8_MEMORY - 1)]);
+        ins.op = chip8Tracing ? ins.base : fusionTable.ops[ins.base][next.base];
+
+        // Loops only waiting for time to pass
+        chip8Instruction third = decode(memory[(address + 4) & (CHIP_8_MEMORY - 1)] << 8 |
+                                        memory[(address + 5) & (CHIP_8_MEMORY - 1)]);
+        if (ins.base == OP_1NNN && ins.NNN == address)
+            ins.op = OP_IDLE_JUMP;
+        if (ins.base == OP_FX07 && next.base == OP_3XNN && next.X == ins.X && next.NN == 0 &&
+            third.base == OP_1NNN && third.NNN == address)
+            ins.op = OP_IDLE_DELAY;
     }
 }
 
+void chip8::invalidateCode(unsigned short address, unsigned short length) {
+    // The instructions starting up to five bytes before the write also read it, through fusion and idle loops
+    for (int i = -5; i < length; i++)
+        decoded[(address + i) & (CHIP_8_MEMORY - 1)].flags = 0;
+
+#ifdef CHIP_8_JIT
+    jit->invalidate(address, length);
+#endif
+}
+
 void chip8::emulateCycle() {
-    opcode = memory[pc] << 8 | memory[pc + 1];
+    auto start = profile.start(pc);
+    const chip8Instruction &ins = fetch(pc);
 
-    switch (opcode & 0xF000) {
+#if defined(CHIP_8_DISPATCH_TABLE) || defined(CHIP_8_DISPATCH_THREADED)
+    (this->*chip8Dispatch::handlers[ins.base])(ins);
+#else
+    switch (ins.opcode & 0xF000) {
         case 0x0000:
 
-            switch (opcode) {
-                case 0x00E0: // 0x00E0 -> Clears the screen
-                    memset(gfx, 0, CHIP_8_SCREEN_WIDTH * CHIP_8_SCREEN_HEIGHT);
-                    drawFlag = true;
-                    pc += 2;
-                    break;
-                case 0x00EE: // 0x00EE -> Returns from subroutine
-                    pc = stack[--sp];
-                    pc += 2;
-                    break;
+            switch (ins.opcode) {
+                case 0x00E0: op00E0(ins); break;
+                case 0x00EE: op00EE(ins); break;
             }
             break;
 
-        case 0x1000: // 0x1NNN -> Jumps to address NNN
-            pc = opcode & 0x0FFF;
-            break;
-        case 0x2000: // 0x2NNN -> Calls subroutine at NNN
-            stack[sp++] = pc;
-            pc = opcode & 0x0FFF;
-            break;
-        case 0x3000: // 0x3XNN -> Skips next if V[X] == NN
-            if (V[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF))
-                pc += 2;
-            pc += 2;
-            break;
-        case 0x4000: // 0x4XNN -> Skips next if V[X] != NN
-            if (V[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF))
-                pc += 2;
-            pc += 2;
-            break;
-        case 0x5000: // 0x5XY0 -> Skips next if V[X] == V[Y]
-            if (V[(opcode & 0x0F00) >> 8] == V[(opcode & 0x00F0) >> 4])
-                pc += 2;
-            pc += 2;
-            break;
-        case 0x6000: // 0x6XNN -> Sets V[X] to NN
-            V[(opcode & 0x0F00) >> 8] = opcode & 0x00FF;
-            pc += 2;
-            break;
-        case 0x7000: // 0x7XNN -> Adds NN to V[X]
-            V[(opcode & 0x0F00) >> 8] += opcode & 0x00FF;
-            pc += 2;
-            break;
+        case 0x1000: op1NNN(ins); break;
+        case 0x2000: op2NNN(ins); break;
+        case 0x3000: op3XNN(ins); break;
+        case 0x4000: op4XNN(ins); break;
+        case 0x5000: op5XY0(ins); break;
+        case 0x6000: op6XNN(ins); break;
+        case 0x7000: op7XNN(ins); break;
 
         case 0x8000:
 
-            switch (opcode & 0x000F) {
-                case 0x0000: // 0x8XY0 -> Sets V[X] to value of V[Y]
-                    V[(opcode & 0x0F00) >> 8] = V[(opcode & 0x00F0) >> 4];
-                    pc += 2;
-                    break;
-                case 0x0001: // 0x8XY1 -> Sets V[X] to V[X] or V[Y]
-                    V[(opcode & 0x0F00) >> 8] |= V[(opcode & 0x00F0) >> 4];
-                    pc += 2;
-                    break;
-                case 0x0002: // 0x8XY2 -> Sets V[X] to V[X] and V[Y]
-                    V[(opcode & 0x0F00) >> 8] &= V[(opcode & 0x00F0) >> 4];
-                    pc += 2;
-                    break;
-                case 0x0003: // 0x8XY3 -> Sets V[X] to V[X] xor V[Y]
-                    V[(opcode & 0x0F00) >> 8] ^= V[(opcode & 0x00F0) >> 4];
-                    pc += 2;
-                    break;
-                case 0x0004: // 0x8XY4 -> Adds V[Y] to V[X] (Flag to 1 when carry)
-                    if (V[(opcode & 0x00F0) >> 4] > (0xFF - V[(opcode & 0x0F00) >> 8]))
-                        V[0xF] = 1; // Carry
-                    else
-                        V[0xF] = 0;
-
-                    V[(opcode & 0x0F00) >> 8] += V[(opcode & 0x00F0) >> 4];
-                    pc += 2;
-                    break;
-                case 0x0005: // 0x8XY5 -> Removes V[Y] to V[X] (Flag to 0 when borrow)
-                    if (V[(opcode & 0x00F0) >> 4] > V[(opcode & 0x0F00) >> 8])
-                        V[0xF] = 0; // Borrow
-                    else
-                        V[0xF] = 1;
-
-                    V[(opcode & 0x0F00) >> 8] -= V[(opcode & 0x00F0) >> 4];
-                    pc += 2;
-                    break;
-                case 0x0006: // 0x8XY6 -> Stores the least significant bit of V[X] in VF and then shifts V[X] to the right by 1
-                    V[0xF] = V[(opcode & 0x0F00) >> 8] & 0x1;
-                    V[(opcode & 0x0F00) >> 8] >>= 1;
-                    pc += 2;
-                    break;
-                case 0x0007: // 0x8XY7 -> Sets V[X] to V[Y] minus V[X]. (Flag to 0 when borrow)
-                    if (V[(opcode & 0x0F00) >> 8] > V[(opcode & 0x00F0) >> 4])
-                        V[0xF] = 0; // Borrow
-                    else
-                        V[0xF] = 1;
-
-                    V[(opcode & 0x0F00) >> 8] = V[(opcode & 0x00F0) >> 4] - V[(opcode & 0x0F00) >> 8];
-                    pc += 2;
-                    break;
-                case 0x000E: // 0x8XYE -> Stores the most significant bit of V[X] in VF and then shifts V[X] to the left by 1
-                    V[0xF] = V[(opcode & 0x0F00) >> 8] & 0x80;
-                    V[(opcode & 0x0F00) >> 8] <<= 1;
-                    pc += 2;
-                    break;
+            switch (ins.opcode & 0x000F) {
+                case 0x0000: op8XY0(ins); break;
+                case 0x0001: op8XY1(ins); break;
+                case 0x0002: op8XY2(ins); break;
+                case 0x0003: op8XY3(ins); break;
+                case 0x0004: op8XY4(ins); break;
+                case 0x0005: op8XY5(ins); break;
+                case 0x0006: op8XY6(ins); break;
+                case 0x0007: op8XY7(ins); break;
+                case 0x000E: op8XYE(ins); break;
             }
             break;
 
-        case 0x9000: // 0x9XY0 -> Skips next if V[X] != V[Y]
-            if (V[(opcode & 0x0F00) >> 8] != V[(opcode & 0x00F0) >> 4])
-                pc += 2;
-            pc += 2;
-            break;
-        case 0xA000: // 0xANNN -> Sets I to NNN
-            I = opcode & 0x0FFF;
-            pc += 2;
-            break;
-        case 0xB000: // 0xBNNN -> Jumps to NNN+V[0]
-            pc = (opcode & 0x0FFF) + V[0];
-            pc += 2;
-            break;
-        case 0xC000: // CXNN -> Sets V[X] to the result of a bitwise and operation on a random number
-            V[(opcode & 0x0F00) >> 8] = (rand() % 0xFF) & (opcode & 0xFF);
-            pc += 2;
-            break;
-        case 0xD000: {// DXYN -> Draw the sprite at memory location I at coordinate (V[X], V[Y]) with a height of N+1 pixels (Flag to 1 if collision)
-            unsigned char VX = V[(opcode & 0x0F00) >> 8];
-            unsigned char VY = V[(opcode & 0x00F0) >> 4];
-            unsigned char N = opcode & 0xF;
-            unsigned short pixel;
-
-            V[0xF] = 0;
-            for (int y = 0; y < N; y++) {
-                pixel = memory[I + y];
-                for (int x = 0; x < 8; x++) {
-
-                    if ((pixel & (0x80 >> x)) != 0) {
-                        if (gfx[(VX + x + ((VY + y) * 64))] == 1)
-                            V[0xF] = 1;
-                        gfx[(VX + x + ((VY + y) * 64))] ^= 1;
-                    }
-
-                }
-            }
+        case 0x9000: op9XY0(ins); break;
+        case 0xA000: opANNN(ins); break;
+        case 0xB000: opBNNN(ins); break;
+        case 0xC000: opCXNN(ins); break;
+        case 0xD000: opDXYN(ins); break;
 
-            drawFlag = true;
-            pc += 2;
-            break;
-        }
         case 0xE000:
 
-            switch (opcode & 0x00FF) {
-                case 0x009E: // EX9E -> Skips if key at V[X] is pressed
-                    if ((key[V[(opcode & 0x0F00) >> 8]] & 0x1) != 0)
-                        pc += 2;
-                    pc += 2;
-                    break;
-                case 0x00A1: // EX9E -> Skips if key at V[X] is pressed
-                    if (key[V[(opcode & 0x0F00) >> 8]] == 0)
-                        pc += 2;
-                    pc += 2;
-                    break;
+            switch (ins.opcode & 0x00FF) {
+                case 0x009E: opEX9E(ins); break;
+                case 0x00A1: opEXA1(ins); break;
             }
             break;
 
         case 0xF000:
 
-            switch (opcode & 0x00FF) {
-                case 0x0007: // 0xFX07 -> Sets V[X] to the value of the delay timer
-                    V[(opcode & 0x0F00) >> 8] = delay_timer;
-                    pc += 2;
-                    break;
-                case 0x000A: {// 0xFX0A -> Waits for a key press and store it in V[X]
-
-                    bool keyPressed = false;
-                    for (int i = 0; i < 16; i++) {
-                        if (key[i] != 0) {
-                            keyPressed = true;
-                            V[(opcode & 0x0F00) >> 8] = i;
-                        }
-                    }
-                    if (!keyPressed) return;
-
-                    pc += 2;
-                    break;
-                }
-                case 0x0015: // 0xFX15 -> Sets the delay timer to V[X]
-                    delay_timer = V[(opcode & 0x0F00) >> 8];
-                    pc += 2;
-                    break;
-                case 0x0018: // 0xFX18 -> Sets the sound timer to V[X]
-                    sound_timer = V[(opcode & 0x0F00) >> 8];
-                    pc += 2;
-                    break;
-                case 0x001E: // 0xFX1E -> Adds V[X] to I
-                    I += V[(opcode & 0x0F00) >> 8];
-                    pc += 2;
-                    break;
-                case 0x0029: // 0xFX19 -> Adds V[X] to I
-                    I = V[(opcode & 0x0F00) >> 8] * 0x5;
-                    pc += 2;
-                    break;
-                case 0x0033: // 0xFX33 -> store the digit of the digital representation of V[X] to I, I+1 and I+2
-                    memory[I] = V[(opcode & 0x0F00) >> 8] / 100;
-                    memory[I + 1] = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
-                    memory[I + 2] = V[(opcode & 0x0F00) >> 8] % 10;
-
-                    pc += 2;
-                    break;
-                case 0x0055: // 0xFX55 -> Stores V0 to VX to memory starting from I
-                    for (int i = 0; i < (opcode & 0x0F00) >> 8; i++)
-                        memory[I + i] = V[i];
-
-                    I += ((opcode & 0x0F00) >> 8) + 1;
-                    pc += 2;
-                    break;
-                case 0x0065: // 0xFX65 -> Fills V0 to VX from memory starting from I
-                    for (int i = 0; i < (opcode & 0x0F00) >> 8; i++)
-                        V[i] = memory[I + i];
-
-                    I += ((opcode & 0x0F00) >> 8) + 1;
-                    pc += 2;
-                    break;
+            switch (ins.opcode & 0x00FF) {
+                case 0x0007: opFX07(ins); break;
+                case 0x000A: opFX0A(ins); break;
+                case 0x0015: opFX15(ins); break;
+                case 0x0018: opFX18(ins); break;
+                case 0x001E: opFX1E(ins); break;
+                case 0x0029: opFX29(ins); break;
+                case 0x0033: opFX33(ins); break;
+                case 0x0055: opFX55(ins); break;
+                case 0x0065: opFX65(ins); break;
             }
             break;
     }
+#endif
+
+    profile.record(ins.base, start);
+    traceInstruction(ins);
+
+    if (waitingForKey) return;
+
+    retire();
+}
+
+inline void chip8::retire() {
+    cycles++;
+}
+
+inline void chip8::readKeys() {
+    keyReads++;
+    if (timeKeyRead) {
+        keyReadTime = std::chrono::steady_clock::now();
+        timeKeyRead = false;
+    }
+}
+
+inline void chip8::traceInstruction(const chip8Instruction &ins) {
+    trace.record(&ins - decoded, ins.opcode, I, V[ins.X], V[0xF]);
+}
 
-    // Update timers
+chip8RunResult chip8::runCycles(unsigned int count, bool stopOnDraw) {
+#if defined(CHIP_8_DISPATCH_THREADED) && !defined(CHIP_8_JIT)
+    return runThreaded(count, stopOnDraw);
+#endif
+
+    unsigned long long target = cycles + count;
+    cycleTarget = target;
+
+    chip8RunResult result = {CHIP_8_STOP_BUDGET, 0, 0};
+
+    while (cycles < target) {
+#if !defined(CHIP_8_DISPATCH_TABLE) || defined(CHIP_8_JIT)
+        // The switch and the JIT run the instructions of a superinstruction one by one, but idle loops are still
+        // skipped, whatever their dispatch they would only spin until the budget runs out
+        const chip8Instruction &idle = fetch(pc);
+        if (idle.op == OP_IDLE_JUMP || idle.op == OP_IDLE_DELAY) {
+            auto start = profile.start(pc);
+            (this->*chip8Dispatch::handlers[idle.op])(idle);
+            profile.record(idle.op, start);
+            traceInstruction(idle);
+            retire();
+            continue;
+        }
+#endif
+#ifdef CHIP_8_JIT
+        // Compiled blocks never draw, wait or run an unknown opcode
+        auto start = profile.start(pc);
+        unsigned int compiled = jit->run(*this, target - cycles);
+        if (compiled > 0) {
+            profile.recordCompiled(compiled, start);
+            cycles += compiled;
+            continue;
+        }
+#endif
+        const chip8Instruction &ins = fetch(pc);
+#if defined(CHIP_8_DISPATCH_TABLE) && !defined(CHIP_8_JIT)
+        // A superinstruction counts as two, only run it if both fit in the budget
+        unsigned char op = target - cycles >= 2 ? ins.op : ins.base;
+#else
+        unsigned char op = ins.base;
+#endif
+        if (op == OP_ILLEGAL) {
+            result.reason = CHIP_8_STOP_ILLEGAL;
+            break;
+        }
+
+#if defined(CHIP_8_DISPATCH_TABLE) && !defined(CHIP_8_JIT)
+        auto start = profile.start(pc);
+        (this->*chip8Dispatch::handlers[op])(ins);
+        profile.record(op, start);
+        traceInstruction(ins);
+        if (!waitingForKey)
+            retire();
+#else
+        emulateCycle();
+#endif
+        if (waitingForKey) {
+            result.reason = CHIP_8_STOP_KEY;
+            break;
+        }
+        if (stopOnDraw && (flagTable.flags[op] & CHIP_8_INSTRUCTION_DRAW)) {
+            result.reason = CHIP_8_STOP_DRAW;
+            break;
+        }
+    }
+
+    result.cycles = count - (target - cycles);
+    return result;
+}
+
+chip8RunResult chip8::runFrames(unsigned int count, bool stopOnDraw) {
+    chip8RunResult result = {CHIP_8_STOP_FRAME, 0, 0};
+
+    while (result.frames < count) {
+        chip8RunResult run = runCycles(cyclesPerFrame - frameCycles, stopOnDraw || waitVblank);
+
+        frameCycles += run.cycles;
+        result.cycles += run.cycles;
+
+        // The next call carries on with the rest of the frame
+        if ((run.reason == CHIP_8_STOP_DRAW && !waitVblank) || run.reason == CHIP_8_STOP_ILLEGAL) {
+            result.reason = run.reason;
+            return result;
+        }
+
+        // The timers keep running while FX0A waits, so the frame ends there, the draw waiting for the vertical blank
+        // ends it too
+        tickTimers();
+        frameCycles = 0;
+        result.frames++;
+
+        if (run.reason == CHIP_8_STOP_KEY || (run.reason == CHIP_8_STOP_DRAW && stopOnDraw)) {
+            result.reason = run.reason;
+            return result;
+        }
+    }
+
+    return result;
+}
+
+#ifdef CHIP_8_DISPATCH_THREADED
+chip8RunResult chip8::runThreaded(unsigned int count, bool stopOnDraw) {
+    // Each handler ends with its own copy of the dispatch, so each one gets its own indirect branch
+    static const void *labels[OP_COUNT] = {
+#define CHIP_8_OP_LABEL(name) &&label##name,
+            CHIP_8_ALL_OPCODES(CHIP_8_OP_LABEL)
+#undef CHIP_8_OP_LABEL
+    };
+
+    unsigned long long target = cycles + count;
+    const chip8Instruction *ins;
+
+    cycleTarget = target;
+
+#define CHIP_8_STOP(reason) \
+    return chip8RunResult{reason, count - (target - cycles), 0};
+
+#define CHIP_8_DISPATCH_NEXT()                                    \
+    if (cycles == target)                                         \
+        CHIP_8_STOP(CHIP_8_STOP_BUDGET)                           \
+    ins = &fetch(pc);                                             \
+    goto *labels[target - cycles >= 2 ? ins->op : ins->base];
+
+    CHIP_8_DISPATCH_NEXT();
+
+#define CHIP_8_OP_THREADED(name)                                          \
+    label##name:                                                          \
+    if constexpr (OP_##name == OP_ILLEGAL)                                \
+        CHIP_8_STOP(CHIP_8_STOP_ILLEGAL)                                  \
+    {                                                                     \
+        auto start = profile.start(pc);                                   \
+        op##name(*ins);                                                   \
+        profile.record(OP_##name, start);                                 \
+        traceInstruction(*ins);                                           \
+    }                                                                     \
+    if constexpr (OP_##name == OP_FX0A) {                                 \
+        if (waitingForKey)                                                \
+            CHIP_8_STOP(CHIP_8_STOP_KEY)                                  \
+    }                                                                     \
+    retire();                                                             \
+    if constexpr (flagTable.flags[OP_##name] & CHIP_8_INSTRUCTION_DRAW) { \
+        if (stopOnDraw)                                                   \
+            CHIP_8_STOP(CHIP_8_STOP_DRAW)                                 \
+    }                                                                     \
+    CHIP_8_DISPATCH_NEXT();
+
+    CHIP_8_ALL_OPCODES(CHIP_8_OP_THREADED)
+
+#undef CHIP_8_OP_THREADED
+#undef CHIP_8_DISPATCH_NEXT
+#undef CHIP_8_STOP
+}
+#endif
+
+void chip8::copyScreen(unsigned char *pixels) const {
+    for (int y = 0; y < CHIP_8_SCREEN_HEIGHT; y++) {
+        for (int x = 0; x < CHIP_8_SCREEN_WIDTH; x++)
+            pixels[y * CHIP_8_SCREEN_WIDTH + x] = gfx[y] >> (63 - x) & 1;
+    }
+}
+
+void chip8::tickTimers() {
     if (delay_timer > 0)
         delay_timer--;
 
     if (sound_timer > 0) {
-        if (sound_timer == 1)
+        if (sound_timer == 1 && soundEnabled)
             std::cout << "BEEP!" << std::endl;
         sound_timer--;
     }
-}
\ No newline at end of file
+}
+
+void chip8::opILLEGAL(const chip8Instruction &ins) {
+    // Unknown opcodes are ignored and the program counter is left as is
+}
+
+void chip8::op00E0(const chip8Instruction &ins) { // 0x00E0 -> Clears the screen
+    for (int y = 0; y < CHIP_8_SCREEN_HEIGHT; y++) {
+        if (gfx[y] != 0)
+            dirtyRows |= 1u << y;
+    }
+    memset(gfx, 0, sizeof(gfx));
+    drawFlag = true;
+    pc += 2;
+}
+
+void chip8::op00EE(const chip8Instruction &ins) { // 0x00EE -> Returns from subroutine
+    pc = stack[--sp];
+    pc += 2;
+}
+
+void chip8::op1NNN(const chip8Instruction &ins) { // 0x1NNN -> Jumps to address NNN
+    pc = ins.NNN;
+}
+
+void chip8::op2NNN(const chip8Instruction &ins) { // 0x2NNN -> Calls subroutine at NNN
+    stack[sp++] = pc;
+    pc = ins.NNN;
+}
+
+void chip8::op3XNN(const chip8Instruction &ins) { // 0x3XNN -> Skips next if V[X] == NN
+    if (V[ins.X] == ins.NN)
+        pc += 2;
+    pc += 2;
+}
+
+void chip8::op4XNN(const chip8Instruction &ins) { // 0x4XNN -> Skips next if V[X] != NN
+    if (V[ins.X] != ins.NN)
+        pc += 2;
+    pc += 2;
+}
+
+void chip8::op5XY0(const chip8Instruction &ins) { // 0x5XY0 -> Skips next if V[X] == V[Y]
+    if (V[ins.X] == V[ins.Y])
+        pc += 2;
+    pc += 2;
+}
+
+void chip8::op6XNN(const chip8Instruction &ins) { // 0x6XNN -> Sets V[X] to NN
+    V[ins.X] = ins.NN;
+    pc += 2;
+}
+
+void chip8::op7XNN(const chip8Instruction &ins) { // 0x7XNN -> Adds NN to V[X]
+    V[ins.X] += ins.NN;
+    pc += 2;
+}
+
+void chip8::op8XY0(const chip8Instruction &ins) { // 0x8XY0 -> Sets V[X] to value of V[Y]
+    V[ins.X] = V[ins.Y];
+    pc += 2;
+}
+
+void chip8::op8XY1(const chip8Instruction &ins) { // 0x8XY1 -> Sets V[X] to V[X] or V[Y]
+    V[ins.X] |= V[ins.Y];
+    pc += 2;
+}
+
+void chip8::op8XY2(const chip8Instruction &ins) { // 0x8XY2 -> Sets V[X] to V[X] and V[Y]
+    V[ins.X] &= V[ins.Y];
+    pc += 2;
+}
+
+void chip8::op8XY3(const chip8Instruction &ins) { // 0x8XY3 -> Sets V[X] to V[X] xor V[Y]
+    V[ins.X] ^= V[ins.Y];
+    pc += 2;
+}
+
+void chip8::op8XY4(const chip8Instruction &ins) { // 0x8XY4 -> Adds V[Y] to V[X] (Flag to 1 when carry)
+    if (V[ins.Y] > (0xFF - V[ins.X]))
+        V[0xF] = 1; // Carry
+    else
+        V[0xF] = 0;
+
+    V[ins.X] += V[ins.Y];
+    pc += 2;
+}
+
+void chip8::op8XY5(const chip8Instruction &ins) { // 0x8XY5 -> Removes V[Y] to V[X] (Flag to 0 when borrow)
+    if (V[ins.Y] > V[ins.X])
+        V[0xF] = 0; // Borrow
+    else
+        V[0xF] = 1;
+
+    V[ins.X] -= V[ins.Y];
+    pc += 2;
+}
+
+void chip8::op8XY6(const chip8Instruction &ins) { // 0x8XY6 -> Stores the least significant bit of V[X] in VF and then shifts V[X] to the right by 1
+    V[0xF] = V[ins.X] & 0x1;
+    V[ins.X] >>= 1;
+    pc += 2;
+}
+
+void chip8::op8XY7(const chip8Instruction &ins) { // 0x8XY7 -> Sets V[X] to V[Y] minus V[X]. (Flag to 0 when borrow)
+    if (V[ins.X] > V[ins.Y])
+        V[0xF] = 0; // Borrow
+    else
+        V[0xF] = 1;
+
+    V[ins.X] = V[ins.Y] - V[ins.X];
+    pc += 2;
+}
+
+void chip8::op8XYE(const chip8Instruction &ins) { // 0x8XYE -> Stores the most significant bit of V[X] in VF and then shifts V[X] to the left by 1
+    V[0xF] = V[ins.X] & 0x80;
+    V[ins.X] <<= 1;
+    pc += 2;
+}
+
+void chip8::op9XY0(const chip8Instruction &ins) { // 0x9XY0 -> Skips next if V[X] != V[Y]
+    if (V[ins.X] != V[ins.Y])
+        pc += 2;
+    pc += 2;
+}
+
+void chip8::opANNN(const chip8Instruction &ins) { // 0xANNN -> Sets I to NNN
+    I = ins.NNN;
+    pc += 2;
+}
+
+void chip8::opBNNN(const chip8Instruction &ins) { // 0xBNNN -> Jumps to NNN+V[0]
+    pc = ins.NNN + V[0];
+    pc += 2;
+}
+
+void chip8::opCXNN(const chip8Instruction &ins) { // CXNN -> Sets V[X] to the result of a bitwise and operation on a random number
+    V[ins.X] = chip8NextRandom(randomState) & ins.NN;
+    pc += 2;
+}
+
+void chip8::opDXYN(const chip8Instruction &ins) { // DXYN -> Draw the sprite at memory location I at coordinate (V[X], V[Y]) with a height of N pixels (Flag to 1 if collision)
+    unsigned char VX = V[ins.X] % CHIP_8_SCREEN_WIDTH;
+    unsigned char VY = V[ins.Y] % CHIP_8_SCREEN_HEIGHT;
+    uint64_t collision = 0;
+
+    // A sprite row is one shifted word, XORed into the screen row, the pixels it turns off are the collisions
+    for (int y = 0; y < ins.N; y++) {
+        unsigned int row = VY + y;
+        if (row >= CHIP_8_SCREEN_HEIGHT) {
+            if (clipSprites)
+                break;
+            row -= CHIP_8_SCREEN_HEIGHT;
+        }
+
+        uint64_t sprite = chip8SpriteRow(memory[(I + y) & (CHIP_8_MEMORY - 1)], VX, clipSprites);
+        collision |= gfx[row] & sprite;
+        gfx[row] ^= sprite;
+        if (sprite != 0)
+            dirtyRows |= 1u << row;
+    }
+
+    V[0xF] = collision != 0;
+    drawFlag = true;
+    pc += 2;
+}
+
+void chip8::opEX9E(const chip8Instruction &ins) { // EX9E -> Skips if key at V[X] is pressed
+    readKeys();
+    if ((key[V[ins.X]] & 0x1) != 0)
+        pc += 2;
+    pc += 2;
+}
+
+void chip8::opEXA1(const chip8Instruction &ins) { // EXA1 -> Skips if key at V[X] is not pressed
+    readKeys();
+    if (key[V[ins.X]] == 0)
+        pc += 2;
+    pc += 2;
+}
+
+void chip8::opFX07(const chip8Instruction &ins) { // 0xFX07 -> Sets V[X] to the value of the delay timer
+    V[ins.X] = delay_timer;
+    pc += 2;
+}
+
+void chip8::opFX0A(const chip8Instruction &ins) { // 0xFX0A -> Waits for a key press and store it in V[X]
+    readKeys();
+    waitingForKey = true;
+    for (int i = 0; i < 16; i++) {
+        if (key[i] != 0) {
+            waitingForKey = false;
+            V[ins.X] = i;
+        }
+    }
+    if (waitingForKey) return;
+
+    pc += 2;
+}
+
+void chip8::opFX15(const chip8Instruction &ins) { // 0xFX15 -> Sets the delay timer to V[X]
+    delay_timer = V[ins.X];
+    pc += 2;
+}
+
+void chip8::opFX18(const chip8Instruction &ins) { // 0xFX18 -> Sets the sound timer to V[X]
+    sound_timer = V[ins.X];
+    pc += 2;
+}
+
+void chip8::opFX1E(const chip8Instruction &ins) { // 0xFX1E -> Adds V[X] to I
+    I += V[ins.X];
+    pc += 2;
+}
+
+void chip8::opFX29(const chip8Instruction &ins) { // 0xFX29 -> Sets I to the location of the font sprite of V[X]
+    I = V[ins.X] * 0x5;
+    pc += 2;
+}
+
+void chip8::opFX33(const chip8Instruction &ins) { // 0xFX33 -> store the digit of the digital representation of V[X] to I, I+1 and I+2
+    memory[I] = V[ins.X] / 100;
+    memory[I + 1] = (V[ins.X] / 10) % 10;
+    memory[I + 2] = V[ins.X] % 10;
+    invalidateCode(I, 3);
+
+    pc += 2;
+}
+
+void chip8::opFX55(const chip8Instruction &ins) { // 0xFX55 -> Stores V0 to VX to memory starting from I
+    for (int i = 0; i < ins.X; i++)
+        memory[I + i] = V[i];
+    invalidateCode(I, ins.X);
+
+    I += ins.X + 1;
+    pc += 2;
+}
+
+void chip8::opFX65(const chip8Instruction &ins) { // 0xFX65 -> Fills V0 to VX from memory starting from I
+    for (int i = 0; i < ins.X; i++)
+        V[i] = memory[I + i];
+
+    I += ins.X + 1;
+    pc += 2;
+}
+
+// Superinstructions, the first instruction is retired here and the second by the dispatch loop
+
+void chip8::op6XNN_6XNN(const chip8Instruction &ins) { // 6XNN 6XNN -> Sets two registers
+    fusionHits[OP_6XNN_6XNN - OP_FIRST_FUSED]++;
+    op6XNN(ins);
+    retire();
+    op6XNN(fetch(pc));
+}
+
+void chip8::opANNN_DXYN(const chip8Instruction &ins) { // ANNN DXYN -> Points I to a sprite and draws it
+    fusionHits[OP_ANNN_DXYN - OP_FIRST_FUSED]++;
+    opANNN(ins);
+    retire();
+    opDXYN(fetch(pc));
+}
+
+void chip8::op3XNN_1NNN(const chip8Instruction &ins) { // 3XNN 1NNN -> Jumps unless V[X] == NN
+    fusionHits[OP_3XNN_1NNN - OP_FIRST_FUSED]++;
+    unsigned short next = pc + 2;
+    op3XNN(ins);
+    if (pc != next) return;
+    retire();
+    op1NNN(fetch(pc));
+}
+
+void chip8::op4XNN_1NNN(const chip8Instruction &ins) { // 4XNN 1NNN -> Jumps unless V[X] != NN
+    fusionHits[OP_4XNN_1NNN - OP_FIRST_FUSED]++;
+    unsigned short next = pc + 2;
+    op4XNN(ins);
+    if (pc != next) return;
+    retire();
+    op1NNN(fetch(pc));
+}
+
+void chip8::op7XNN_3XNN(const chip8Instruction &ins) { // 7XNN 3XNN -> Counts and skips when the count is reached
+    fusionHits[OP_7XNN_3XNN - OP_FIRST_FUSED]++;
+    op7XNN(ins);
+    retire();
+    op3XNN(fetch(pc));
+}
+
+void chip8::op7XNN_4XNN(const chip8Instruction &ins) { // 7XNN 4XNN -> Counts and skips until the count is reached
+    fusionHits[OP_7XNN_4XNN - OP_FIRST_FUSED]++;
+    op7XNN(ins);
+    retire();
+    op4XNN(fetch(pc));
+}
+
+void chip8::opIDLE_JUMP(const chip8Instruction &ins) { // 1NNN to itself -> Nothing changes until the budget runs out
+    fusionHits[OP_IDLE_JUMP - OP_FIRST_FUSED]++;
+    unsigned long long skipped = cycleTarget - cycles - 1;
+    cycles += skipped;
+    idleCycles += skipped;
+    op1NNN(ins);
+}
+
+void chip8::opIDLE_DELAY(const chip8Instruction &ins) { // FX07 3X00 1NNN to FX07 -> Waits for the delay timer to reach 0
+    fusionHits[OP_IDLE_DELAY - OP_FIRST_FUSED]++;
+
+    // The timer only changes between frames, so a running timer keeps the loop going until the budget runs out.
+    // Every iteration takes 3 instructions, the last FX07 is left to run.
+    if (delay_timer > 0) {
+        unsigned long long skipped = (cycleTarget - cycles - 1) / 3 * 3;
+        cycles += skipped;
+        idleCycles += skipped;
+    }
+    opFX07(ins);
+}
+
+void chip8::printFusionStats(FILE *out) {
+    fprintf(out, "%-10s %8s %14s %8s\n", "fusion", "sites", "hits", "share");
+
+    for (int op = OP_FIRST_FUSED; op < OP_COUNT; op++) {
+        int sites = 0;
+        for (const chip8Instruction &ins : decoded)
+            if ((ins.flags & CHIP_8_INSTRUCTION_DECODED) && ins.op == op)
+                sites++;
+
+        unsigned long long hits = fusionHits[op - OP_FIRST_FUSED];
+        fprintf(out, "%-10s %8d %14llu %7.2f%%\n", opNames[op], sites, hits,
+                cycles ? 100.0 * hits / cycles : 0.0);
+    }
+
+    fprintf(out, "%-10s %8s %14llu %7.2f%%\n", "idle", "", idleCycles, cycles ? 100.0 * idleCycles / cycles : 0.0);
+}
+
+void chip8::printProfile(FILE *out, unsigned int top) {
+#ifdef CHIP_8_PROFILE
+    unsigned long long runs = profile.compiledRuns;
+    unsigned long long ticks = profile.compiledTicks;
+    for (int op = 0; op < OP_COUNT; op++) {
+        runs += profile.opRuns[op];
+        ticks += profile.opTicks[op];
+    }
+
+    fprintf(out, "profile %llu handler runs, %llu %s ticks, %.1f per run\n", runs, ticks,
+            chip8Profile<true>::clockUnit, runs ? (double) ticks / runs : 0.0);
+    fprintf(out, "reading the clock costs about %llu ticks, included in every run\n",
+            (unsigned long long) chip8Profile<true>::overhead());
+
+    int ops[OP_COUNT];
+    std::iota(ops, ops + OP_COUNT, 0);
+    std::sort(ops, ops + OP_COUNT, [&](int a, int b) { return profile.opTicks[a] > profile.opTicks[b]; });
+
+    fprintf(out, "%-10s %14s %8s %16s %8s %10s\n", "handler", "runs", "share", "ticks", "share", "per run");
+    for (int op : ops) {
+        if (profile.opRuns[op] == 0)
+            continue;
+        fprintf(out, "%-10s %14llu %7.2f%% %16llu %7.2f%% %10.1f\n", opNames[op], profile.opRuns[op],
+                100.0 * profile.opRuns[op] / runs, profile.opTicks[op], ticks ? 100.0 * profile.opTicks[op] / ticks : 0.0,
+                (double) profile.opTicks[op] / profile.opRuns[op]);
+    }
+    if (profile.compiledRuns > 0)
+        fprintf(out, "%-10s %14llu %7.2f%% %16llu %7.2f%% %10.1f\n", "compiled", profile.compiledRuns,
+                100.0 * profile.compiledRuns / runs, profile.compiledTicks,
+                ticks ? 100.0 * profile.compiledTicks / ticks : 0.0,
+                (double) profile.compiledTicks / profile.compiledRuns);
+
+    // Hottest guest addresses, with the instruction found there now
+    std::vector<unsigned short> addresses;
+    for (int address = 0; address < CHIP_8_MEMORY; address++)
+        if (profile.addressRuns[address] > 0)
+            addresses.push_back(address);
+
+    size_t shown = std::min<size_t>(top, addresses.size());
+    std::partial_sort(addresses.begin(), addresses.begin() + shown, addresses.end(),
+                      [&](unsigned short a, unsigned short b) {
+                          return profile.addressTicks[a] > profile.addressTicks[b];
+                      });
+
+    fprintf(out, "\n%-6s %-6s %-10s %14s %16s %8s %10s\n", "pc", "opcode", "handler", "runs", "ticks", "share",
+            "per run");
+    for (size_t i = 0; i < shown; i++) {
+        unsigned short address = addresses[i];
+        chip8Instruction ins = decode(memory[address] << 8 | memory[(address + 1) & (CHIP_8_MEMORY - 1)]);
+
+        fprintf(out, "0x%03X  %04X   %-10s %14llu %16llu %7.2f%% %10.1f\n", address, ins.opcode, opNames[ins.base],
+                profile.addressRuns[address], profile.addressTicks[address],
+                ticks ? 100.0 * profile.addressTicks[address] / ticks : 0.0,
+                (double) profile.addressTicks[address] / profile.addressRuns[address]);
+    }
+#else
+    fprintf(out, "profile not built in, configure with -DCHIP_8_PROFILE=ON\n");
+#endif
+}
+
+void chip8::dumpProfile(FILE *out) {
+#ifdef CHIP_8_PROFILE
+    fprintf(out, "{\n");
+    fprintf(out, "  \"clock\": \"%s\",\n", chip8Profile<true>::clockUnit);
+    fprintf(out, "  \"clock_overhead\": %llu,\n", (unsigned long long) chip8Profile<true>::overhead());
+    fprintf(out, "  \"compiled\": {\"runs\": %llu, \"ticks\": %llu},\n", profile.compiledRuns,
+            profile.compiledTicks);
+
+    fprintf(out, "  \"handlers\": [");
+    const char *separator = "\n";
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (profile.opRuns[op] == 0)
+            continue;
+        fprintf(out, "%s    {\"handler\": \"%s\", \"runs\": %llu, \"ticks\": %llu}", separator, opNames[op],
+                profile.opRuns[op], profile.opTicks[op]);
+        separator = ",\n";
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"addresses\": [");
+    separator = "\n";
+    for (int address = 0; address < CHIP_8_MEMORY; address++) {
+        if (profile.addressRuns[address] == 0)
+            continue;
+        chip8Instruction ins = decode(memory[address] << 8 | memory[(address + 1) & (CHIP_8_MEMORY - 1)]);
+        fprintf(out, "%s    {\"pc\": %d, \"opcode\": \"%04X\", \"handler\": \"%s\", \"runs\": %llu, \"ticks\": %llu}",
+                separator, address, ins.opcode, opNames[ins.base], profile.addressRuns[address],
+                profile.addressTicks[address]);
+        separator = ",\n";
+    }
+    fprintf(out, "\n  ]\n");
+    fprintf(out, "}\n");
+#else
+    fprintf(out, "{\"error\": \"profile not built in, configure with -DCHIP_8_PROFILE=ON\"}\n");
+#endif
+}
+
+#ifdef CHIP_8_TRACE
+// Writes all of data, write may take less than asked
+static bool writeAll(int fd, const void *data, size_t length) {
+    const char *bytes = (const char *) data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written <= 0)
+            return false;
+        bytes += written;
+        length -= written;
+    }
+
+    return true;
+}
+#endif
+
+void chip8::startTrace(size_t entries) {
+    trace.start(entries);
+}
+
+bool chip8::dumpTrace(int fd) const {
+#ifdef CHIP_8_TRACE
+    uint64_t size = trace.mask + 1;
+    uint64_t count = std::min(trace.head, size);
+    chip8TraceHeader header = {CHIP_8_TRACE_MAGIC, CHIP_8_TRACE_VERSION, trace.head, count};
+
+    // The oldest entry is count before head, the ring is written from there to its end, then from its start
+    uint64_t first = (trace.head - count) & trace.mask;
+    uint64_t tail = std::min(count, size - first);
+
+    return writeAll(fd, &header, sizeof(header)) &&
+           writeAll(fd, trace.ring.data() + first, tail * sizeof(chip8TraceEntry)) &&
+           writeAll(fd, trace.ring.data(), (count - tail) * sizeof(chip8TraceEntry));
+#else
+    return false;
+#endif
+}
+
+bool chip8::dumpTrace(const char *path) const {
+    if (!chip8Tracing)
+        return false;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    bool written = dumpTrace(fd);
+    return close(fd) == 0 && written;
+}
@@ -1,23 +1,285 @@
 #pragma once
 
 #include <iostream>
+#include <bit>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <cstdio>
+#include <span>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "chip8_trace.h"
+
+#ifdef CHIP_8_PROFILE
+#include <algorithm>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifdef CHIP_8_JIT
+#include <memory>
+
+#include "chip8_jit.h"
+#endif
+
 #define CHIP_8_MEMORY 4096
+// Games are loaded at 0x200, after the interpreter, and may fill the memory up to the end
+#define CHIP_8_PROGRAM_START 0x200
+#define CHIP_8_MAX_GAME_SIZE (CHIP_8_MEMORY - CHIP_8_PROGRAM_START)
 #define CHIP_8_REGISTER 16
 #define CHIP_8_STACK 16
 #define CHIP_8_SCREEN_WIDTH 64
 #define CHIP_8_SCREEN_HEIGHT 32
+#define CHIP_8_FRAME_RATE 60
+#define CHIP_8_CYCLES_PER_FRAME 10
+#define CHIP_8_RANDOM_SEED 0
 
-class chip8 {
-private:
+// Every opcode handler of the interpreter, used to generate the handler declarations and dispatch tables
+#define CHIP_8_OPCODES(OP) \
+        OP(ILLEGAL)        \
+        OP(00E0)           \
+        OP(00EE)           \
+        OP(1NNN)           \
+        OP(2NNN)           \
+        OP(3XNN)           \
+        OP(4XNN)           \
+        OP(5XY0)           \
+        OP(6XNN)           \
+        OP(7XNN)           \
+        OP(8XY0)           \
+        OP(8XY1)           \
+        OP(8XY2)           \
+        OP(8XY3)           \
+        OP(8XY4)           \
+        OP(8XY5)           \
+        OP(8XY6)           \
+        OP(8XY7)           \
+        OP(8XYE)           \
+        OP(9XY0)           \
+        OP(ANNN)           \
+        OP(BNNN)           \
+        OP(CXNN)           \
+        OP(DXYN)           \
+        OP(EX9E)           \
+        OP(EXA1)           \
+        OP(FX07)           \
+        OP(FX0A)           \
+        OP(FX15)           \
+        OP(FX18)           \
+        OP(FX1E)           \
+        OP(FX29)           \
+        OP(FX33)           \
+        OP(FX55)           \
+        OP(FX65)
+
+// Superinstructions, common pairs of instructions run by a single handler
+#define CHIP_8_FUSED_OPCODES(OP) \
+        OP(6XNN_6XNN)            \
+        OP(ANNN_DXYN)            \
+        OP(3XNN_1NNN)            \
+        OP(4XNN_1NNN)            \
+        OP(7XNN_3XNN)            \
+        OP(7XNN_4XNN)            \
+        OP(IDLE_JUMP)            \
+        OP(IDLE_DELAY)
+
+#define CHIP_8_ALL_OPCODES(OP) \
+        CHIP_8_OPCODES(OP)     \
+        CHIP_8_FUSED_OPCODES(OP)
+
+enum chip8Op : unsigned char {
+#define CHIP_8_OP_ENUM(name) OP_##name,
+    CHIP_8_ALL_OPCODES(CHIP_8_OP_ENUM)
+#undef CHIP_8_OP_ENUM
+    OP_COUNT,
+    OP_FIRST_FUSED = OP_6XNN_6XNN
+};
+
+#define CHIP_8_FUSED_COUNT (OP_COUNT - OP_FIRST_FUSED)
+
+#ifdef CHIP_8_PROFILE
+constexpr bool chip8Profiling = true;
+#else
+constexpr bool chip8Profiling = false;
+#endif
+
+// Runs and host cycles of each handler and of each guest address, counted by the interpreter when built with
+// CHIP_8_PROFILE. A superinstruction counts as one run of its own handler, at the address of its first instruction.
+template<bool enabled>
+struct chip8Profile;
+
+// Without CHIP_8_PROFILE there is nothing to count, the calls to the profile compile to nothing. start takes pc by
+// reference so that it is not even read.
+template<>
+struct chip8Profile<false> {
+    struct mark {};
+
+    void clear() {}
+    mark start(const unsigned short &address) const { return {}; }
+    void record(unsigned char op, const mark &start) {}
+    void recordCompiled(unsigned int instructions, const mark &start) {}
+};
+
+#ifdef CHIP_8_PROFILE
+template<>
+struct chip8Profile<true> {
+    unsigned long long opRuns[OP_COUNT];
+    unsigned long long opTicks[OP_COUNT];
+    unsigned long long addressRuns[CHIP_8_MEMORY];
+    unsigned long long addressTicks[CHIP_8_MEMORY];
+    // Instructions run by compiled blocks of the JIT, which are not broken down
+    unsigned long long compiledRuns;
+    unsigned long long compiledTicks;
+
+    // Time stamp, in cycles of the time stamp counter on x86 and in nanoseconds elsewhere
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    static constexpr const char *clockUnit = "rdtsc";
+#else
+    static constexpr const char *clockUnit = "ns";
+#endif
+
+    static uint64_t clock() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    void clear() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    // Ticks of reading the clock twice, which every run recorded includes
+    static uint64_t overhead() {
+        uint64_t lowest = UINT64_MAX;
+
+        for (int i = 0; i < 1000; i++) {
+            uint64_t start = clock();
+            lowest = std::min<uint64_t>(lowest, clock() - start);
+        }
+
+        return lowest;
+    }
+
+    // Time and address at which a handler starts
+    struct mark {
+        uint64_t ticks;
+        unsigned short address;
+    };
+
+    mark start(const unsigned short &address) const {
+        return {clock(), address};
+    }
+
+    void record(unsigned char op, const mark &start) {
+        uint64_t ticks = clock() - start.ticks;
+
+        opRuns[op]++;
+        opTicks[op] += ticks;
+        addressRuns[start.address & (CHIP_8_MEMORY - 1)]++;
+        addressTicks[start.address & (CHIP_8_MEMORY - 1)] += ticks;
+    }
+
+    void recordCompiled(unsigned int instructions, const mark &start) {
+        compiledRuns += instructions;
+        compiledTicks += clock() - start.ticks;
+    }
+};
+#endif
+
+// Flags of a decoded instruction
+#define CHIP_8_INSTRUCTION_DECODED 0x01 // The entry holds a decoded instruction
+#define CHIP_8_INSTRUCTION_BRANCH 0x02 // May set pc to something else than the next instruction
+#define CHIP_8_INSTRUCTION_DRAW 0x04 // Changes the screen
+#define CHIP_8_INSTRUCTION_WRITE 0x08 // Writes to memory
+#define CHIP_8_INSTRUCTION_WAIT 0x10 // May block until a key is pressed
+
+// Opcode split into its operands
+struct chip8Instruction {
     unsigned short opcode;
+    unsigned short NNN;
+    unsigned char op; // Handler, may be a superinstruction also running the next instruction
+    unsigned char base; // Handler of this instruction alone
+    unsigned char X;
+    unsigned char Y;
+    unsigned char N;
+    unsigned char NN;
+    unsigned char flags;
+};
+
+// Why a run of instructions stopped
+enum chip8StopReason {
+    CHIP_8_STOP_BUDGET, // Every requested instruction was executed
+    CHIP_8_STOP_FRAME, // Every requested frame was completed
+    CHIP_8_STOP_KEY, // FX0A waits for a key press
+    CHIP_8_STOP_DRAW, // An instruction changed the screen
+    CHIP_8_STOP_ILLEGAL // pc is on an unknown opcode, which is not executed
+};
+
+// Why a game was not loaded
+enum chip8LoadError {
+    CHIP_8_LOAD_OK,
+    CHIP_8_LOAD_CANNOT_OPEN, // The file does not exist or is not readable
+    CHIP_8_LOAD_CANNOT_READ, // Reading or mapping the file failed
+    CHIP_8_LOAD_EMPTY, // There is nothing to load
+    CHIP_8_LOAD_TOO_LARGE // The game does not fit from 0x200 to the end of the memory
+};
+
+// Message of a load error, for the user
+const char *chip8LoadErrorString(chip8LoadError error);
+
+struct chip8RunResult {
+    chip8StopReason reason;
+    unsigned long long cycles; // Instructions executed
+    unsigned int frames; // Frames completed, timers ticked once for each
+};
+
+extern unsigned char chip8_fontset[80];
+
+#define CHIP_8_STATE_MAGIC 0x38504843 // "CHP8" in the first four bytes of a save state
+#define CHIP_8_STATE_VERSION 1
+
+// Everything a game can observe, as saved by chip8::snapshot
+//
+// The layout is fixed and has no padding so that a state is written to a file as it is, in the byte order of the host.
+// Changing it means bumping CHIP_8_STATE_VERSION, restore refuses states of another version.
+struct chip8State {
+    uint32_t magic;
+    uint32_t version;
+
+    uint64_t gfx[CHIP_8_SCREEN_HEIGHT];
+    uint64_t randomState;
+    uint64_t cycles;
+    uint32_t frameCycles;
+
+    uint16_t stack[CHIP_8_STACK];
+    uint16_t I;
+    uint16_t pc;
+    uint16_t sp;
+
+    uint8_t V[CHIP_8_REGISTER];
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t key[16];
+    uint8_t waitingForKey;
+    uint8_t reserved[3];
+
+    uint8_t memory[CHIP_8_MEMORY];
+};
+
+static_assert(sizeof(chip8State) == 4456, "chip8State must not have padding");
 
+class chip8 {
+private:
     unsigned char memory[CHIP_8_MEMORY];
     unsigned char V[CHIP_8_REGISTER];
 
@@ -30,17 +292,164 @@ private:
     unsigned short stack[CHIP_8_STACK];
     unsigned short sp;
 
+    // Set by FX0A while no key is pressed, pc stays on it until one is
+    bool waitingForKey = false;
+
+    // State of the generator of the random numbers of CXNN
+    uint64_t randomState;
+
+    // Number of instructions executed since initialize
+    unsigned long long cycles = 0;
+    // Value of cycles at which the current runCycles stops
+    unsigned long long cycleTarget = 0;
+    // Instructions already executed in the current frame by runFrames
+    unsigned int frameCycles = 0;
+    // Number of instructions skipped by fast-forwarding idle loops
+    unsigned long long idleCycles = 0;
+    // Number of runs of each superinstruction
+    unsigned long long fusionHits[CHIP_8_FUSED_COUNT];
+
+    // Handler runs and host cycles, empty unless built with CHIP_8_PROFILE
+    [[no_unique_address]] chip8Profile<chip8Profiling> profile;
+    // Last instructions run, empty unless built with CHIP_8_TRACE
+    [[no_unique_address]] chip8Trace<chip8Tracing> trace;
+
+    // Instruction decoded at each address of the memory, filled when a game is loaded or lazily on execution
+    chip8Instruction decoded[CHIP_8_MEMORY];
+
+    void predecode(unsigned short start, unsigned short end);
+    void invalidateCode(unsigned short address, unsigned short length);
+    inline const chip8Instruction &fetch(unsigned short address);
+
+    inline void retire();
+    // Counts a read of the keys by EX9E, EXA1 or FX0A and times it if the host asked for it
+    inline void readKeys();
+    // Records an instruction of decoded that just ran in the trace
+    inline void traceInstruction(const chip8Instruction &ins);
+
+#ifdef CHIP_8_DISPATCH_THREADED
+    chip8RunResult runThreaded(unsigned int count, bool stopOnDraw);
+#endif
+
+#ifdef CHIP_8_JIT
+    // Translation of the hot blocks to native code
+    std::unique_ptr<chip8Jit> jit;
+
+    friend class chip8Jit;
+#endif
+
+#define CHIP_8_OP_DECLARE(name) void op##name(const chip8Instruction &ins);
+    CHIP_8_ALL_OPCODES(CHIP_8_OP_DECLARE)
+#undef CHIP_8_OP_DECLARE
+
+    friend struct chip8Dispatch;
+    friend class chip8Batch;
+
 public:
 
-    unsigned char gfx[CHIP_8_SCREEN_WIDTH * CHIP_8_SCREEN_HEIGHT];
+    // One bit per pixel, bit 63 of a row is its leftmost pixel
+    uint64_t gfx[CHIP_8_SCREEN_HEIGHT];
+    // One bit per row of gfx changed since the host last cleared it, bit y for row y
+    uint32_t dirtyRows = 0;
 
     unsigned char key[16];
     bool drawFlag = false;
+    // Number of EX9E, EXA1 and FX0A run, tells the host when the game last looked at the keys
+    unsigned long long keyReads = 0;
+    // Set by the host after changing the keys, the next EX9E, EXA1 or FX0A stores the time in keyReadTime and clears it
+    bool timeKeyRead = false;
+    std::chrono::steady_clock::time_point keyReadTime;
 
+    // Instructions to run between two ticks of the timers
+    unsigned int cyclesPerFrame = CHIP_8_CYCLES_PER_FRAME;
+    // Prints BEEP! when the sound timer runs out
+    bool soundEnabled = true;
+    // Sprites crossing an edge of the screen are cut there instead of wrapping around to the other side
+    bool clipSprites = false;
+    // A draw ends the frame, the game waits for the next vertical blank like on the COSMAC VIP
+    bool waitVblank = false;
+
+    // Resets the machine, the random numbers start again from CHIP_8_RANDOM_SEED
     void initialize();
-    void loadGame(const char *gamePath);
+    // Copies a game to 0x200, the memory is left untouched when it cannot be loaded
+    chip8LoadError loadGame(std::span<const unsigned char> game);
+    // Maps the file of a game and loads it, to load one game in many instances map it once with a chip8Rom
+    chip8LoadError loadGame(const char *gamePath);
+    // Restarts the random numbers of CXNN, the same seed gives the same numbers
+    void seedRandom(uint64_t seed);
+
+    // Copies the machine to state, mid-frame included, runFrames carries on from there after a restore
+    void snapshot(chip8State &state) const;
+    // Puts the machine back in a snapshot state, returns false and leaves it untouched for a state of another version,
+    // with sp past the stack or with more instructions done in the frame than cyclesPerFrame. pc and I are wrapped to
+    // the memory.
+    bool restore(const chip8State &state);
+    // Snapshot written to or read from a file, false if it cannot be written, read or restored
+    bool saveState(const char *path) const;
+    bool loadState(const char *path);
     void emulateCycle();
+    // Runs count instructions, stopping early on FX0A waiting for a key, an unknown opcode or, if asked, a draw
+    chip8RunResult runCycles(unsigned int count, bool stopOnDraw = false);
+    // Runs count frames of cyclesPerFrame instructions and ticks the timers after each. A frame interrupted by a draw
+    // or an unknown opcode is resumed by the next call, FX0A waiting for a key ends the frame, and so does a draw with
+    // waitVblank.
+    chip8RunResult runFrames(unsigned int count, bool stopOnDraw = false);
+    // Decrements the delay and sound timers, once per frame
+    void tickTimers();
     void setKeys();
+    // Expands the screen to one byte per pixel, 0 or 1
+    void copyScreen(unsigned char *pixels) const;
+
+    // Prints how often each superinstruction was found in memory and executed
+    void printFusionStats(FILE *out);
+    // Prints the handlers and the top guest addresses sorted by the host cycles spent in them, needs CHIP_8_PROFILE
+    void printProfile(FILE *out, unsigned int top = 20);
+    // Writes the profile as JSON, every handler and address that ran, needs CHIP_8_PROFILE
+    void dumpProfile(FILE *out);
+
+    // Keeps the last entries instructions run from now on, needs CHIP_8_TRACE
+    void startTrace(size_t entries = CHIP_8_TRACE_SIZE);
+    // Writes the trace, oldest instruction first, for chip8-trace to decode. The descriptor version only calls write, so
+    // that a signal handler can dump the trace of a crashed process. False when it cannot be written or there is no
+    // trace in this build.
+    bool dumpTrace(int fd) const;
+    bool dumpTrace(const char *path) const;
 
     void debug();
 };
+
+inline const chip8Instruction &chip8::fetch(unsigned short address) {
+    chip8Instruction &ins = decoded[address & (CHIP_8_MEMORY - 1)];
+
+    if (!(ins.flags & CHIP_8_INSTRUCTION_DECODED))
+        predecode(address & (CHIP_8_MEMORY - 1), (address & (CHIP_8_MEMORY - 1)) + 1);
+
+    return ins;
+}
+
+// State of the random number generator for a seed, splitmix64 spreads close seeds apart and avoids the zero state
+inline uint64_t chip8RandomState(uint64_t seed) {
+    uint64_t state = seed + 0x9E3779B97F4A7C15ULL;
+
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+    state ^= state >> 31;
+
+    return state != 0 ? state : 1;
+}
+
+// Next random byte, from xorshift64*
+inline unsigned char chip8NextRandom(uint64_t &state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+
+    return (state * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+// Row of 8 sprite pixels placed at column x of a screen row, cut at the right edge or wrapped around to the left
+inline uint64_t chip8SpriteRow(unsigned char sprite, unsigned int x, bool clip) {
+    uint64_t row = (uint64_t) sprite << (64 - 8);
+
+    return clip ? row >> x : std::rotr(row, x);
+}
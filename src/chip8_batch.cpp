@@ -0,0 +1,618 @@
+#include "chip8_batch.h"
+#include "chip8_rom.h"
+
+#define CHIP_8_LANES CHIP_8_BATCH_LANES
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CHIP_8_BATCH_SCALAR)
+
+// One register of every lane in a vector, the compiler lowers them to AVX2 or SSE4 depending on the target
+typedef unsigned char laneBytes __attribute__((vector_size(CHIP_8_LANES)));
+typedef unsigned short laneWords __attribute__((vector_size(CHIP_8_LANES * 2)));
+typedef signed char laneSignedBytes __attribute__((vector_size(CHIP_8_LANES)));
+typedef signed short laneSignedWords __attribute__((vector_size(CHIP_8_LANES * 2)));
+
+static inline laneBytes splatBytes(unsigned char value) {
+    return laneBytes{} + value;
+}
+
+static inline laneWords splatWords(unsigned short value) {
+    return laneWords{} + value;
+}
+
+static inline laneBytes equal(laneBytes a, laneBytes b) {
+    return (laneBytes) (a == b);
+}
+
+static inline laneWords equal(laneWords a, laneWords b) {
+    return (laneWords) (a == b);
+}
+
+static inline laneBytes greater(laneBytes a, laneBytes b) {
+    return (laneBytes) (a > b);
+}
+
+// Zero extends each lane
+static inline laneWords widen(laneBytes value) {
+    return __builtin_convertvector(value, laneWords);
+}
+
+// Sign extends each lane, so a 0xFF mask stays all ones
+static inline laneWords widenMask(laneBytes mask) {
+    return (laneWords) __builtin_convertvector((laneSignedBytes) mask, laneSignedWords);
+}
+
+static inline laneBytes narrowMask(laneWords mask) {
+    return (laneBytes) __builtin_convertvector((laneSignedWords) mask, laneSignedBytes);
+}
+
+#else
+
+// Scalar fallback, the same operations written as loops over the lanes
+struct laneBytes {
+    unsigned char lane[CHIP_8_LANES];
+};
+
+struct laneWords {
+    unsigned short lane[CHIP_8_LANES];
+};
+
+#define CHIP_8_LANE_OPERATOR(type, op)                            \
+    static inline type operator op(type a, type b) {              \
+        type result;                                              \
+        for (unsigned int l = 0; l < CHIP_8_LANES; l++)           \
+            result.lane[l] = a.lane[l] op b.lane[l];              \
+        return result;                                            \
+    }
+
+#define CHIP_8_LANE_SHIFT(type, op)                               \
+    static inline type operator op(type a, int shift) {           \
+        type result;                                              \
+        for (unsigned int l = 0; l < CHIP_8_LANES; l++)           \
+            result.lane[l] = a.lane[l] op shift;                  \
+        return result;                                            \
+    }
+
+#define CHIP_8_LANE_OPERATORS(type) \
+    CHIP_8_LANE_OPERATOR(type, +)   \
+    CHIP_8_LANE_OPERATOR(type, -)   \
+    CHIP_8_LANE_OPERATOR(type, &)   \
+    CHIP_8_LANE_OPERATOR(type, |)   \
+    CHIP_8_LANE_OPERATOR(type, ^)   \
+    CHIP_8_LANE_SHIFT(type, <<)     \
+    CHIP_8_LANE_SHIFT(type, >>)
+
+CHIP_8_LANE_OPERATORS(laneBytes)
+CHIP_8_LANE_OPERATORS(laneWords)
+
+#undef CHIP_8_LANE_OPERATORS
+#undef CHIP_8_LANE_SHIFT
+#undef CHIP_8_LANE_OPERATOR
+
+static inline laneBytes operator~(laneBytes a) {
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        a.lane[l] = ~a.lane[l];
+    return a;
+}
+
+static inline laneWords operator~(laneWords a) {
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        a.lane[l] = ~a.lane[l];
+    return a;
+}
+
+static inline laneBytes splatBytes(unsigned char value) {
+    laneBytes result;
+    memset(result.lane, value, sizeof(result.lane));
+    return result;
+}
+
+static inline laneWords splatWords(unsigned short value) {
+    laneWords result;
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        result.lane[l] = value;
+    return result;
+}
+
+static inline laneBytes equal(laneBytes a, laneBytes b) {
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        a.lane[l] = a.lane[l] == b.lane[l] ? 0xFF : 0;
+    return a;
+}
+
+static inline laneWords equal(laneWords a, laneWords b) {
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        a.lane[l] = a.lane[l] == b.lane[l] ? 0xFFFF : 0;
+    return a;
+}
+
+static inline laneBytes greater(laneBytes a, laneBytes b) {
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        a.lane[l] = a.lane[l] > b.lane[l] ? 0xFF : 0;
+    return a;
+}
+
+static inline laneWords widen(laneBytes value) {
+    laneWords result;
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        result.lane[l] = value.lane[l];
+    return result;
+}
+
+static inline laneWords widenMask(laneBytes mask) {
+    laneWords result;
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        result.lane[l] = mask.lane[l] ? 0xFFFF : 0;
+    return result;
+}
+
+static inline laneBytes narrowMask(laneWords mask) {
+    laneBytes result;
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        result.lane[l] = mask.lane[l] ? 0xFF : 0;
+    return result;
+}
+
+#endif
+
+static inline laneBytes loadBytes(const unsigned char *address) {
+    laneBytes value;
+    memcpy(&value, address, sizeof(value));
+    return value;
+}
+
+static inline void storeBytes(unsigned char *address, laneBytes value) {
+    memcpy(address, &value, sizeof(value));
+}
+
+static inline laneWords loadWords(const unsigned short *address) {
+    laneWords value;
+    memcpy(&value, address, sizeof(value));
+    return value;
+}
+
+static inline void storeWords(unsigned short *address, laneWords value) {
+    memcpy(address, &value, sizeof(value));
+}
+
+// Lanes of a where the mask is set, lanes of b elsewhere
+template<typename lanes>
+static inline lanes select(lanes mask, lanes a, lanes b) {
+    return (a & mask) | (b & ~mask);
+}
+
+void chip8Batch::initialize() {
+    memset(V, 0, sizeof(V));
+    memset(I, 0, sizeof(I));
+    memset(delay_timer, 0, sizeof(delay_timer));
+    memset(sound_timer, 0, sizeof(sound_timer));
+    memset(stack, 0, sizeof(stack));
+    memset(sp, 0, sizeof(sp));
+    memset(memory, 0, sizeof(memory));
+    memset(gfx, 0, sizeof(gfx));
+    memset(key, 0, sizeof(key));
+
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+        pc[l] = 0x200;
+        memcpy(memory[l], chip8_fontset, 80);
+        drawFlag[l] = true;
+    }
+    seedRandom(CHIP_8_RANDOM_SEED);
+
+    steps = 0;
+    uniformSteps = 0;
+    groups = 0;
+}
+
+void chip8Batch::seedRandom(uint64_t seed) {
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        randomState[l] = chip8RandomState(seed + l);
+}
+
+chip8LoadError chip8Batch::loadGame(std::span<const unsigned char> game) {
+    if (game.empty())
+        return CHIP_8_LOAD_EMPTY;
+    if (game.size() > CHIP_8_MAX_GAME_SIZE)
+        return CHIP_8_LOAD_TOO_LARGE;
+
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        memcpy(memory[l] + CHIP_8_PROGRAM_START, game.data(), game.size());
+
+    return CHIP_8_LOAD_OK;
+}
+
+chip8LoadError chip8Batch::loadGame(const char *gamePath) {
+    chip8Rom rom;
+
+    chip8LoadError error = rom.open(gamePath);
+    if (error != CHIP_8_LOAD_OK)
+        return error;
+
+    return loadGame(rom.bytes());
+}
+
+static constexpr auto buildEveryLane() {
+    struct {
+        alignas(32) unsigned char lanes[CHIP_8_LANES];
+    } table{};
+
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+        table.lanes[l] = 0xFF;
+
+    return table;
+}
+static constexpr auto everyLane = buildEveryLane();
+
+void chip8Batch::step() {
+    alignas(32) unsigned short opcode[CHIP_8_LANES];
+    alignas(32) unsigned char lanes[CHIP_8_LANES];
+
+    unsigned short first = memory[0][pc[0] & (CHIP_8_MEMORY - 1)] << 8 | memory[0][(pc[0] + 1) & (CHIP_8_MEMORY - 1)];
+    unsigned short divergent = 0;
+    bool random = false;
+
+    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+        opcode[l] = memory[l][pc[l] & (CHIP_8_MEMORY - 1)] << 8 | memory[l][(pc[l] + 1) & (CHIP_8_MEMORY - 1)];
+        divergent |= opcode[l] ^ first;
+        random |= (opcode[l] & 0xF000) == 0xC000;
+    }
+
+    // Each lane draws from its own generator, and only when it runs CXNN, like a chip8 would
+    if (random) {
+        for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+            if ((opcode[l] & 0xF000) == 0xC000)
+                this->random[l] = chip8NextRandom(randomState[l]);
+        }
+    }
+
+    steps++;
+
+    if (!divergent) {
+        execute(opcode[0], everyLane.lanes);
+        uniformSteps++;
+        groups++;
+        return;
+    }
+
+    // One bit per lane not run yet, the lowest one picks the opcode of the next group
+    unsigned long long left = (1ULL << CHIP_8_LANES) - 1;
+
+    while (left) {
+        unsigned short leader = opcode[__builtin_ctzll(left)];
+
+        for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+            lanes[l] = opcode[l] == leader && (left >> l & 1) ? 0xFF : 0;
+        for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+            left &= ~((unsigned long long) (lanes[l] & 1) << l);
+
+        execute(leader, lanes);
+        groups++;
+    }
+}
+
+// Runs an instruction in the lanes where lanes is 0xFF, the same as the chip8 opcode handlers do
+void chip8Batch::execute(unsigned short opcode, const unsigned char *lanes) {
+    unsigned char X = (opcode & 0x0F00) >> 8;
+    unsigned char Y = (opcode & 0x00F0) >> 4;
+    unsigned char N = opcode & 0x000F;
+    unsigned char NN = opcode & 0x00FF;
+    unsigned short NNN = opcode & 0x0FFF;
+
+    laneBytes mask = loadBytes(lanes);
+    laneWords mask16 = widenMask(mask);
+    laneWords PC = loadWords(pc);
+    laneWords next = select(mask16, PC + splatWords(2), PC);
+
+    // Skips the next instruction in the lanes where condition is set
+    auto skipIf = [&](laneBytes condition) {
+        storeWords(pc, select(mask16, PC + splatWords(2) + (widenMask(condition) & splatWords(2)), PC));
+    };
+    auto setV = [&](unsigned char x, laneBytes value) {
+        storeBytes(V[x], select(mask, value, loadBytes(V[x])));
+    };
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            switch (opcode) {
+                case 0x00E0: // 0x00E0 -> Clears the screen
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                        if (lanes[l]) {
+                            memset(gfx[l], 0, sizeof(gfx[l]));
+                            drawFlag[l] = true;
+                        }
+                    }
+                    storeWords(pc, next);
+                    break;
+
+                case 0x00EE: // 0x00EE -> Returns from subroutine
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                        if (lanes[l]) {
+                            sp[l] = (sp[l] - 1) & (CHIP_8_STACK - 1);
+                            pc[l] = stack[sp[l]][l] + 2;
+                        }
+                    }
+                    break;
+
+                default: // 0x0NNN machine code routines are not supported, pc stays
+                    break;
+            }
+            break;
+
+        case 0x1000: // 0x1NNN -> Jumps to address NNN
+            storeWords(pc, select(mask16, splatWords(NNN), PC));
+            break;
+
+        case 0x2000: // 0x2NNN -> Calls subroutine at NNN
+            for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                if (lanes[l]) {
+                    stack[sp[l]][l] = pc[l];
+                    sp[l] = (sp[l] + 1) & (CHIP_8_STACK - 1);
+                    pc[l] = NNN;
+                }
+            }
+            break;
+
+        case 0x3000: // 0x3XNN -> Skips next if V[X] == NN
+            skipIf(equal(loadBytes(V[X]), splatBytes(NN)));
+            break;
+
+        case 0x4000: // 0x4XNN -> Skips next if V[X] != NN
+            skipIf(~equal(loadBytes(V[X]), splatBytes(NN)));
+            break;
+
+        case 0x5000: // 0x5XY0 -> Skips next if V[X] == V[Y]
+            skipIf(equal(loadBytes(V[X]), loadBytes(V[Y])));
+            break;
+
+        case 0x6000: // 0x6XNN -> Sets V[X] to NN
+            setV(X, splatBytes(NN));
+            storeWords(pc, next);
+            break;
+
+        case 0x7000: // 0x7XNN -> Adds NN to V[X]
+            setV(X, loadBytes(V[X]) + splatBytes(NN));
+            storeWords(pc, next);
+            break;
+
+        case 0x8000:
+            // VF is written before V[X], which then sees the new VF when X or Y is F, like the handlers
+            switch (N) {
+                case 0x0: // 0x8XY0 -> Sets V[X] to value of V[Y]
+                    setV(X, loadBytes(V[Y]));
+                    break;
+
+                case 0x1: // 0x8XY1 -> Sets V[X] to V[X] or V[Y]
+                    setV(X, loadBytes(V[X]) | loadBytes(V[Y]));
+                    break;
+
+                case 0x2: // 0x8XY2 -> Sets V[X] to V[X] and V[Y]
+                    setV(X, loadBytes(V[X]) & loadBytes(V[Y]));
+                    break;
+
+                case 0x3: // 0x8XY3 -> Sets V[X] to V[X] xor V[Y]
+                    setV(X, loadBytes(V[X]) ^ loadBytes(V[Y]));
+                    break;
+
+                case 0x4: // 0x8XY4 -> Adds V[Y] to V[X] (Flag to 1 when carry)
+                    setV(0xF, greater(loadBytes(V[Y]), splatBytes(0xFF) - loadBytes(V[X])) & splatBytes(1));
+                    setV(X, loadBytes(V[X]) + loadBytes(V[Y]));
+                    break;
+
+                case 0x5: // 0x8XY5 -> Removes V[Y] to V[X] (Flag to 0 when borrow)
+                    setV(0xF, ~greater(loadBytes(V[Y]), loadBytes(V[X])) & splatBytes(1));
+                    setV(X, loadBytes(V[X]) - loadBytes(V[Y]));
+                    break;
+
+                case 0x6: // 0x8XY6 -> Stores the least significant bit of V[X] in VF and then shifts V[X] to the right by 1
+                    setV(0xF, loadBytes(V[X]) & splatBytes(0x1));
+                    setV(X, loadBytes(V[X]) >> 1);
+                    break;
+
+                case 0x7: // 0x8XY7 -> Sets V[X] to V[Y] minus V[X]. (Flag to 0 when borrow)
+                    setV(0xF, ~greater(loadBytes(V[X]), loadBytes(V[Y])) & splatBytes(1));
+                    setV(X, loadBytes(V[Y]) - loadBytes(V[X]));
+                    break;
+
+                case 0xE: // 0x8XYE -> Stores the most significant bit of V[X] in VF and then shifts V[X] to the left by 1
+                    setV(0xF, loadBytes(V[X]) & splatBytes(0x80));
+                    setV(X, loadBytes(V[X]) << 1);
+                    break;
+
+                default: // Unknown opcode, pc stays
+                    return;
+            }
+            storeWords(pc, next);
+            break;
+
+        case 0x9000: // 0x9XY0 -> Skips next if V[X] != V[Y]
+            skipIf(~equal(loadBytes(V[X]), loadBytes(V[Y])));
+            break;
+
+        case 0xA000: // 0xANNN -> Sets I to NNN
+            storeWords(I, select(mask16, splatWords(NNN), loadWords(I)));
+            storeWords(pc, next);
+            break;
+
+        case 0xB000: // 0xBNNN -> Jumps to NNN+V[0]
+            storeWords(pc, select(mask16, splatWords(NNN + 2) + widen(loadBytes(V[0])), PC));
+            break;
+
+        case 0xC000: // CXNN -> Sets V[X] to the result of a bitwise and operation on a random number
+            setV(X, loadBytes(random) & splatBytes(NN));
+            storeWords(pc, next);
+            break;
+
+        case 0xD000: // DXYN -> Draw the sprite at memory location I at coordinate (V[X], V[Y]) with a height of N pixels (Flag to 1 if collision)
+            for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                if (!lanes[l])
+                    continue;
+
+                unsigned char VX = V[X][l] % CHIP_8_SCREEN_WIDTH;
+                unsigned char VY = V[Y][l] % CHIP_8_SCREEN_HEIGHT;
+                uint64_t collision = 0;
+
+                for (int y = 0; y < N; y++) {
+                    unsigned int row = VY + y;
+                    if (row >= CHIP_8_SCREEN_HEIGHT) {
+                        if (clipSprites)
+                            break;
+                        row -= CHIP_8_SCREEN_HEIGHT;
+                    }
+
+                    uint64_t sprite = chip8SpriteRow(memory[l][(I[l] + y) & (CHIP_8_MEMORY - 1)], VX, clipSprites);
+                    collision |= gfx[l][row] & sprite;
+                    gfx[l][row] ^= sprite;
+                }
+
+                V[0xF][l] = collision != 0;
+                drawFlag[l] = true;
+            }
+            storeWords(pc, next);
+            break;
+
+        case 0xE000: {
+            alignas(32) unsigned char pressed[CHIP_8_LANES];
+
+            switch (NN) {
+                case 0x9E: // EX9E -> Skips if key at V[X] is pressed
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+                        pressed[l] = (key[l][V[X][l] & 0xF] & 0x1) != 0 ? 0xFF : 0;
+                    skipIf(loadBytes(pressed));
+                    break;
+
+                case 0xA1: // EXA1 -> Skips if key at V[X] is not pressed
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++)
+                        pressed[l] = key[l][V[X][l] & 0xF] == 0 ? 0xFF : 0;
+                    skipIf(loadBytes(pressed));
+                    break;
+
+                default: // Unknown opcode, pc stays
+                    break;
+            }
+            break;
+        }
+
+        case 0xF000:
+            switch (NN) {
+                case 0x07: // 0xFX07 -> Sets V[X] to the value of the delay timer
+                    setV(X, loadBytes(delay_timer));
+                    break;
+
+                case 0x0A: // 0xFX0A -> Waits for a key press and store it in V[X]
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                        if (!lanes[l])
+                            continue;
+
+                        bool waiting = true;
+                        for (int i = 0; i < 16; i++) {
+                            if (key[l][i] != 0) {
+                                waiting = false;
+                                V[X][l] = i;
+                            }
+                        }
+                        if (!waiting)
+                            pc[l] += 2;
+                    }
+                    return;
+
+                case 0x15: // 0xFX15 -> Sets the delay timer to V[X]
+                    storeBytes(delay_timer, select(mask, loadBytes(V[X]), loadBytes(delay_timer)));
+                    break;
+
+                case 0x18: // 0xFX18 -> Sets the sound timer to V[X]
+                    storeBytes(sound_timer, select(mask, loadBytes(V[X]), loadBytes(sound_timer)));
+                    break;
+
+                case 0x1E: // 0xFX1E -> Adds V[X] to I
+                    storeWords(I, select(mask16, loadWords(I) + widen(loadBytes(V[X])), loadWords(I)));
+                    break;
+
+                case 0x29: { // 0xFX29 -> Sets I to the location of the font sprite of V[X]
+                    laneWords VX = widen(loadBytes(V[X]));
+                    storeWords(I, select(mask16, (VX << 2) + VX, loadWords(I)));
+                    break;
+                }
+
+                case 0x33: // 0xFX33 -> store the digit of the digital representation of V[X] to I, I+1 and I+2
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                        if (lanes[l]) {
+                            memory[l][I[l] & (CHIP_8_MEMORY - 1)] = V[X][l] / 100;
+                            memory[l][(I[l] + 1) & (CHIP_8_MEMORY - 1)] = (V[X][l] / 10) % 10;
+                            memory[l][(I[l] + 2) & (CHIP_8_MEMORY - 1)] = V[X][l] % 10;
+                        }
+                    }
+                    break;
+
+                case 0x55: // 0xFX55 -> Stores V0 to VX to memory starting from I
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                        if (lanes[l]) {
+                            for (int i = 0; i < X; i++)
+                                memory[l][(I[l] + i) & (CHIP_8_MEMORY - 1)] = V[i][l];
+                            I[l] += X + 1;
+                        }
+                    }
+                    break;
+
+                case 0x65: // 0xFX65 -> Fills V0 to VX from memory starting from I
+                    for (unsigned int l = 0; l < CHIP_8_LANES; l++) {
+                        if (lanes[l]) {
+                            for (int i = 0; i < X; i++)
+                                V[i][l] = memory[l][(I[l] + i) & (CHIP_8_MEMORY - 1)];
+                            I[l] += X + 1;
+                        }
+                    }
+                    break;
+
+                default: // Unknown opcode, pc stays
+                    return;
+            }
+            storeWords(pc, next);
+            break;
+    }
+}
+
+void chip8Batch::runFrames(unsigned int count) {
+    for (unsigned int frame = 0; frame < count; frame++) {
+        for (unsigned int i = 0; i < cyclesPerFrame; i++)
+            step();
+
+        tickTimers();
+    }
+}
+
+void chip8Batch::tickTimers() {
+    laneBytes one = splatBytes(1);
+    laneBytes zero = splatBytes(0);
+
+    laneBytes delay = loadBytes(delay_timer);
+    storeBytes(delay_timer, delay - (greater(delay, zero) & one));
+
+    laneBytes sound = loadBytes(sound_timer);
+    storeBytes(sound_timer, sound - (greater(sound, zero) & one));
+}
+
+bool chip8Batch::matches(unsigned int lane, const chip8 &reference) const {
+    for (int i = 0; i < CHIP_8_REGISTER; i++) {
+        if (V[i][lane] != reference.V[i])
+            return false;
+    }
+
+    if (I[lane] != reference.I || pc[lane] != reference.pc || sp[lane] != reference.sp)
+        return false;
+    if (delay_timer[lane] != reference.delay_timer || sound_timer[lane] != reference.sound_timer)
+        return false;
+    if (randomState[lane] != reference.randomState)
+        return false;
+
+    for (int i = 0; i < reference.sp && i < CHIP_8_STACK; i++) {
+        if (stack[i][lane] != reference.stack[i])
+            return false;
+    }
+
+    return memcmp(memory[lane], reference.memory, CHIP_8_MEMORY) == 0 &&
+           memcmp(gfx[lane], reference.gfx, sizeof(gfx[lane])) == 0;
+}
+
+void chip8Batch::printStats(FILE *out) {
+    fprintf(out, "lanes %d steps %llu in lockstep %.1f%% groups per step %.2f\n", CHIP_8_LANES, steps,
+            steps ? 100.0 * uniformSteps / steps : 0.0, steps ? (double) groups / steps : 0.0);
+}
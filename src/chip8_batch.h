@@ -0,0 +1,70 @@
+#pragma once
+
+#include "chip8.h"
+
+#ifndef CHIP_8_BATCH_LANES
+#define CHIP_8_BATCH_LANES 16
+#endif
+
+// Many instances of the same game run in lockstep, one per SIMD lane
+//
+// The state is stored as a structure of arrays: V[x][lane], I[lane], pc[lane]... so an instruction updates a register
+// of every lane with one vector operation. Each step runs one instruction in every lane, lanes on the same opcode as
+// one masked vector operation, and the lanes that went somewhere else after a skip or a jump in further groups.
+// Instructions touching memory, the screen, the stack or the keys loop over the lanes of their group.
+class chip8Batch {
+private:
+    alignas(32) unsigned char V[CHIP_8_REGISTER][CHIP_8_BATCH_LANES];
+
+    alignas(32) unsigned short I[CHIP_8_BATCH_LANES];
+    alignas(32) unsigned short pc[CHIP_8_BATCH_LANES];
+
+    alignas(32) unsigned char delay_timer[CHIP_8_BATCH_LANES];
+    alignas(32) unsigned char sound_timer[CHIP_8_BATCH_LANES];
+
+    unsigned short stack[CHIP_8_STACK][CHIP_8_BATCH_LANES];
+    unsigned char sp[CHIP_8_BATCH_LANES];
+
+    // Generator of the random numbers of each lane, and the numbers of the lanes running CXNN in the current step
+    uint64_t randomState[CHIP_8_BATCH_LANES];
+    alignas(32) unsigned char random[CHIP_8_BATCH_LANES];
+
+    // Padded by a cache line, lanes 4 KB apart would all compete for the same cache sets
+    unsigned char memory[CHIP_8_BATCH_LANES][CHIP_8_MEMORY + 64];
+
+    // Number of steps, of steps where every lane ran the same opcode, and of groups of lanes run
+    unsigned long long steps = 0;
+    unsigned long long uniformSteps = 0;
+    unsigned long long groups = 0;
+
+    void execute(unsigned short opcode, const unsigned char *lanes);
+
+public:
+    // Screen of each lane, bit-packed like chip8::gfx
+    uint64_t gfx[CHIP_8_BATCH_LANES][CHIP_8_SCREEN_HEIGHT];
+
+    unsigned char key[CHIP_8_BATCH_LANES][16];
+    bool drawFlag[CHIP_8_BATCH_LANES];
+
+    // Instructions to run between two ticks of the timers
+    unsigned int cyclesPerFrame = CHIP_8_CYCLES_PER_FRAME;
+    // Sprites crossing an edge of the screen are cut there instead of wrapping around to the other side
+    bool clipSprites = false;
+
+    void initialize();
+    // Lane l draws the same random numbers as a chip8 seeded with seed + l
+    void seedRandom(uint64_t seed);
+    // Loads the same game in every lane
+    chip8LoadError loadGame(std::span<const unsigned char> game);
+    chip8LoadError loadGame(const char *gamePath);
+    // Runs one instruction in every lane, like chip8::emulateCycle on each instance in turn
+    void step();
+    // Runs count frames of cyclesPerFrame steps, ticking the timers after each
+    void runFrames(unsigned int count);
+    void tickTimers();
+
+    // Returns true if a lane has the same state as a chip8 run with the same keys
+    bool matches(unsigned int lane, const chip8 &reference) const;
+    // Prints how often the lanes ran in lockstep
+    void printStats(FILE *out);
+};
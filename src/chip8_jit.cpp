@@ -0,0 +1,614 @@
+//
+// x86-64 recompiler of chip8 blocks
+//
+
+#include "chip8_jit.h"
+#include "chip8.h"
+
+#include <algorithm>
+#include <sys/mman.h>
+
+// Host registers
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// rdi points to the context, r15 holds the remaining budget, rax and rdx are scratch
+static const int registerPool[] = {RBX, RBP, R12, R13, R14, RSI, R8, R9, R10, R11, RCX};
+#define CHIP_8_JIT_POOL (sizeof(registerPool) / sizeof(registerPool[0]))
+
+// Guest register index used for I in the allocation
+#define GUEST_I 16
+
+#define CONTEXT_I 16
+#define CONTEXT_PC 18
+
+// Worst case size of a block, checked before compiling one
+#define CHIP_8_JIT_BLOCK_BYTES 8192
+
+// Code of the blocks whose first instruction is not translated, the interpreter runs it without trying again
+static unsigned char uncompilable;
+
+enum blockKind {
+    KIND_UNSUPPORTED,
+    KIND_STRAIGHT,
+    KIND_TERMINATOR
+};
+
+static blockKind classify(unsigned char op) {
+    switch (op) {
+        case OP_6XNN:
+        case OP_7XNN:
+        case OP_8XY0:
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+        case OP_8XY4:
+        case OP_8XY5:
+        case OP_8XY6:
+        case OP_8XY7:
+        case OP_8XYE:
+        case OP_ANNN:
+        case OP_FX1E:
+            return KIND_STRAIGHT;
+        case OP_1NNN:
+        case OP_3XNN:
+        case OP_4XNN:
+        case OP_5XY0:
+        case OP_9XY0:
+            return KIND_TERMINATOR;
+        default:
+            return KIND_UNSUPPORTED;
+    }
+}
+
+// Bitmask of the guest registers an instruction needs in host registers
+static unsigned int guestRegisters(const chip8Instruction &ins) {
+    switch (ins.base) {
+        case OP_6XNN:
+        case OP_7XNN:
+        case OP_3XNN:
+        case OP_4XNN:
+            return 1u << ins.X;
+        case OP_8XY0:
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+        case OP_5XY0:
+        case OP_9XY0:
+            return 1u << ins.X | 1u << ins.Y;
+        case OP_8XY4:
+        case OP_8XY5:
+        case OP_8XY7:
+            return 1u << ins.X | 1u << ins.Y | 1u << 0xF;
+        case OP_8XY6:
+        case OP_8XYE:
+            return 1u << ins.X | 1u << 0xF;
+        case OP_ANNN:
+            return 1u << GUEST_I;
+        case OP_FX1E:
+            return 1u << ins.X | 1u << GUEST_I;
+        default:
+            return 0;
+    }
+}
+
+static unsigned int guestWrites(const chip8Instruction &ins) {
+    switch (ins.base) {
+        case OP_6XNN:
+        case OP_7XNN:
+        case OP_8XY0:
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+            return 1u << ins.X;
+        case OP_8XY4:
+        case OP_8XY5:
+        case OP_8XY6:
+        case OP_8XY7:
+        case OP_8XYE:
+            return 1u << ins.X | 1u << 0xF;
+        case OP_ANNN:
+        case OP_FX1E:
+            return 1u << GUEST_I;
+        default:
+            return 0;
+    }
+}
+
+struct emitter {
+    unsigned char *code;
+    size_t pos;
+
+    void byte(unsigned char b) { code[pos++] = b; }
+
+    void word(unsigned short w) {
+        byte(w & 0xFF);
+        byte(w >> 8);
+    }
+
+    void dword(unsigned int d) {
+        for (int i = 0; i < 4; i++)
+            byte((d >> (i * 8)) & 0xFF);
+    }
+
+    // The REX prefix is always emitted so that 4 to 7 address spl, bpl, sil and dil instead of ah to bh
+    void rex8(int reg, int rm) { byte(0x40 | (reg >= 8 ? 0x04 : 0) | (rm >= 8 ? 0x01 : 0)); }
+
+    // op r/m8, r8
+    void rr8(unsigned char opcode, int dst, int src) {
+        rex8(src, dst);
+        byte(opcode);
+        byte(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    // op r/m8, imm8 (0x80 group)
+    void ri8(unsigned char extension, int dst, unsigned char imm) {
+        rex8(0, dst);
+        byte(0x80);
+        byte(0xC0 | extension << 3 | (dst & 7));
+        byte(imm);
+    }
+
+    void movImm8(int dst, unsigned char imm) {
+        rex8(0, dst);
+        byte(0xB0 + (dst & 7));
+        byte(imm);
+    }
+
+    void movImm32(int dst, unsigned int imm) {
+        if (dst >= 8)
+            byte(0x41);
+        byte(0xB8 + (dst & 7));
+        dword(imm);
+    }
+
+    void setcc(unsigned char condition, int dst) {
+        rex8(0, dst);
+        byte(0x0F);
+        byte(condition);
+        byte(0xC0 | (dst & 7));
+    }
+
+    // shl/shr r/m8, 1
+    void shift1(unsigned char extension, int dst) {
+        rex8(0, dst);
+        byte(0xD0);
+        byte(0xC0 | extension << 3 | (dst & 7));
+    }
+
+    // mov r8, [rdi + offset]
+    void loadByte(int dst, unsigned char offset) {
+        rex8(dst, RDI);
+        byte(0x8A);
+        byte(0x40 | (dst & 7) << 3 | RDI);
+        byte(offset);
+    }
+
+    // mov [rdi + offset], r8
+    void storeByte(int src, unsigned char offset) {
+        rex8(src, RDI);
+        byte(0x88);
+        byte(0x40 | (src & 7) << 3 | RDI);
+        byte(offset);
+    }
+
+    // movzx r32, word [rdi + offset]
+    void loadWord(int dst, unsigned char offset) {
+        if (dst >= 8)
+            byte(0x44);
+        byte(0x0F);
+        byte(0xB7);
+        byte(0x40 | (dst & 7) << 3 | RDI);
+        byte(offset);
+    }
+
+    // mov [rdi + offset], r16
+    void storeWord(int src, unsigned char offset) {
+        byte(0x66);
+        if (src >= 8)
+            byte(0x44);
+        byte(0x89);
+        byte(0x40 | (src & 7) << 3 | RDI);
+        byte(offset);
+    }
+
+    // mov word [rdi + offset], imm16
+    void storeWordImm(unsigned char offset, unsigned short imm) {
+        byte(0x66);
+        byte(0xC7);
+        byte(0x40 | RDI);
+        byte(offset);
+        word(imm);
+    }
+
+    // movzx eax, r8
+    void zeroExtendToEax(int src) {
+        rex8(RAX, src);
+        byte(0x0F);
+        byte(0xB6);
+        byte(0xC0 | (src & 7));
+    }
+
+    // add r32, eax
+    void addEax(int dst) {
+        if (dst >= 8)
+            byte(0x41);
+        byte(0x01);
+        byte(0xC0 | (dst & 7));
+    }
+
+    // jmp or jcc rel32, returns the position of the displacement
+    size_t jump(unsigned char condition = 0) {
+        if (condition) {
+            byte(0x0F);
+            byte(condition);
+        } else
+            byte(0xE9);
+        dword(0);
+        return pos - 4;
+    }
+
+    void patch(size_t displacement, const unsigned char *target) {
+        int relative = (int) (target - (code + displacement + 4));
+        memcpy(code + displacement, &relative, 4);
+    }
+};
+
+// Condition codes
+#define CC_JE 0x84
+#define CC_JNE 0x85
+#define CC_JS 0x88
+#define CC_SETC 0x92
+#define CC_SETNC 0x93
+
+// 0x80 group and r/m8, r8 opcodes
+#define OP8_ADD 0x00
+#define OP8_OR 0x08
+#define OP8_AND 0x20
+#define OP8_SUB 0x28
+#define OP8_XOR 0x30
+#define OP8_CMP 0x38
+#define OP8_MOV 0x88
+#define EXT_ADD 0
+#define EXT_AND 4
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+chip8Jit::chip8Jit() {
+    void *memory = mmap(nullptr, CHIP_8_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory != MAP_FAILED)
+        buffer = (unsigned char *) memory;
+
+    flush();
+}
+
+chip8Jit::~chip8Jit() {
+    if (buffer)
+        munmap(buffer, CHIP_8_JIT_BUFFER_SIZE);
+}
+
+void chip8Jit::flush() {
+    memset(blocks, 0, sizeof(blocks));
+    memset(covered, 0, sizeof(covered));
+    for (auto &link : links)
+        link.clear();
+
+    used = 0;
+    if (buffer)
+        emitPrologue();
+}
+
+void chip8Jit::emitPrologue() {
+    emitter e{buffer, 0};
+
+    // Save the callee-saved registers, budget in r15, then jump to the block
+    e.byte(0x53); // push rbx
+    e.byte(0x55); // push rbp
+    e.byte(0x41), e.byte(0x54); // push r12
+    e.byte(0x41), e.byte(0x55); // push r13
+    e.byte(0x41), e.byte(0x56); // push r14
+    e.byte(0x41), e.byte(0x57); // push r15
+    e.byte(0x49), e.byte(0x89), e.byte(0xD7); // mov r15, rdx
+    e.byte(0xFF), e.byte(0xE6); // jmp rsi
+
+    // Every exit ends here with the guest state already stored, the remaining budget is returned
+    epilogue = buffer + e.pos;
+    e.byte(0x4C), e.byte(0x89), e.byte(0xF8); // mov rax, r15
+    e.byte(0x41), e.byte(0x5F); // pop r15
+    e.byte(0x41), e.byte(0x5E); // pop r14
+    e.byte(0x41), e.byte(0x5D); // pop r13
+    e.byte(0x41), e.byte(0x5C); // pop r12
+    e.byte(0x5D); // pop rbp
+    e.byte(0x5B); // pop rbx
+    e.byte(0xC3); // ret
+
+    enter = (entryPoint) buffer;
+    used = e.pos;
+}
+
+unsigned char *chip8Jit::compile(chip8 &c, unsigned short start) {
+    const chip8Instruction *instructions[CHIP_8_JIT_MAX_BLOCK];
+    int count = 0;
+    unsigned int used_registers = 0;
+
+    // Find the extent of the block
+    for (unsigned short pc = start; count < CHIP_8_JIT_MAX_BLOCK && pc < CHIP_8_JIT_ADDRESSES - 1; pc += 2) {
+        const chip8Instruction &ins = c.fetch(pc);
+        blockKind kind = classify(ins.base);
+
+        if (kind == KIND_UNSUPPORTED)
+            break;
+
+        unsigned int registers = used_registers | guestRegisters(ins);
+        if ((unsigned int) __builtin_popcount(registers) > CHIP_8_JIT_POOL)
+            break;
+
+        used_registers = registers;
+        instructions[count++] = &ins;
+
+        if (kind == KIND_TERMINATOR)
+            break;
+    }
+
+    if (count == 0) {
+        if (start < CHIP_8_JIT_ADDRESSES - 1) {
+            blocks[start] = {&uncompilable, nullptr, 2, {}, 0};
+            covered[start]++;
+            covered[start + 1]++;
+        }
+        return nullptr;
+    }
+
+    if (used + CHIP_8_JIT_BLOCK_BYTES > CHIP_8_JIT_BUFFER_SIZE)
+        flush();
+
+    // Allocate a host register to each guest register of the block
+    int host[17];
+    unsigned int dirty = 0;
+    int next = 0;
+    for (int guest = 0; guest < 17; guest++)
+        host[guest] = (used_registers & 1u << guest) ? registerPool[next++] : -1;
+
+    emitter e{buffer, used};
+    unsigned char *entry = buffer + used;
+
+    struct exitStub {
+        size_t displacement;
+        unsigned short target;
+    };
+    exitStub exits[2];
+    int exitCount = 0;
+    size_t budgetExits[CHIP_8_JIT_MAX_BLOCK];
+
+    auto exitTo = [&](unsigned short target, unsigned char condition) {
+        size_t displacement = e.jump(condition);
+        exits[exitCount++] = {displacement, target};
+    };
+
+    auto writeBack = [&](unsigned int registers) {
+        for (int guest = 0; guest < 16; guest++)
+            if (registers & 1u << guest)
+                e.storeByte(host[guest], guest);
+        if (registers & 1u << GUEST_I)
+            e.storeWord(host[GUEST_I], CONTEXT_I);
+    };
+
+    for (int guest = 0; guest < 16; guest++)
+        if (host[guest] >= 0)
+            e.loadByte(host[guest], guest);
+    if (host[GUEST_I] >= 0)
+        e.loadWord(host[GUEST_I], CONTEXT_I);
+
+    unsigned short pc = start;
+    for (int i = 0; i < count; i++, pc += 2) {
+        const chip8Instruction &ins = *instructions[i];
+        int VX = host[ins.X];
+        int VY = host[ins.Y];
+        int VF = host[0xF];
+        int I = host[GUEST_I];
+
+        // Take the instruction from the budget, or leave before it if there is none left
+        e.byte(0x49), e.byte(0xFF), e.byte(0xCF); // dec r15
+        budgetExits[i] = e.jump(CC_JS);
+
+        dirty |= guestWrites(ins);
+
+        switch (ins.base) {
+            case OP_6XNN:
+                e.movImm8(VX, ins.NN);
+                break;
+            case OP_7XNN:
+                e.ri8(EXT_ADD, VX, ins.NN);
+                break;
+            case OP_8XY0:
+                e.rr8(OP8_MOV, VX, VY);
+                break;
+            case OP_8XY1:
+                e.rr8(OP8_OR, VX, VY);
+                break;
+            case OP_8XY2:
+                e.rr8(OP8_AND, VX, VY);
+                break;
+            case OP_8XY3:
+                e.rr8(OP8_XOR, VX, VY);
+                break;
+            case OP_8XY4: // VF is written before V[X] is, like the interpreter does
+                e.rr8(OP8_MOV, RAX, VX);
+                e.rr8(OP8_ADD, RAX, VY);
+                e.setcc(CC_SETC, RDX);
+                e.rr8(OP8_MOV, VF, RDX);
+                e.rr8(OP8_ADD, VX, VY);
+                break;
+            case OP_8XY5:
+                e.rr8(OP8_MOV, RAX, VX);
+                e.rr8(OP8_SUB, RAX, VY);
+                e.setcc(CC_SETNC, RDX);
+                e.rr8(OP8_MOV, VF, RDX);
+                e.rr8(OP8_SUB, VX, VY);
+                break;
+            case OP_8XY6:
+                e.rr8(OP8_MOV, RAX, VX);
+                e.ri8(EXT_AND, RAX, 0x1);
+                e.rr8(OP8_MOV, VF, RAX);
+                e.shift1(EXT_SHR, VX);
+                break;
+            case OP_8XY7:
+                e.rr8(OP8_MOV, RAX, VY);
+                e.rr8(OP8_SUB, RAX, VX);
+                e.setcc(CC_SETNC, RDX);
+                e.rr8(OP8_MOV, VF, RDX);
+                e.rr8(OP8_MOV, RAX, VY);
+                e.rr8(OP8_SUB, RAX, VX);
+                e.rr8(OP8_MOV, VX, RAX);
+                break;
+            case OP_8XYE:
+                e.rr8(OP8_MOV, RAX, VX);
+                e.ri8(EXT_AND, RAX, 0x80);
+                e.rr8(OP8_MOV, VF, RAX);
+                e.shift1(EXT_SHL, VX);
+                break;
+            case OP_ANNN:
+                e.movImm32(I, ins.NNN);
+                break;
+            case OP_FX1E:
+                e.zeroExtendToEax(VX);
+                e.addEax(I);
+                break;
+            case OP_1NNN:
+                writeBack(dirty);
+                exitTo(ins.NNN, 0);
+                break;
+            case OP_3XNN:
+            case OP_4XNN:
+                writeBack(dirty);
+                e.ri8(EXT_CMP, VX, ins.NN);
+                exitTo(pc + 4, ins.base == OP_3XNN ? CC_JE : CC_JNE);
+                exitTo(pc + 2, 0);
+                break;
+            case OP_5XY0:
+            case OP_9XY0:
+                writeBack(dirty);
+                e.rr8(OP8_CMP, VX, VY);
+                exitTo(pc + 4, ins.base == OP_5XY0 ? CC_JE : CC_JNE);
+                exitTo(pc + 2, 0);
+                break;
+        }
+    }
+
+    // Fell through to an instruction left to the interpreter
+    if (classify(instructions[count - 1]->base) != KIND_TERMINATOR) {
+        writeBack(dirty);
+        exitTo(pc, 0);
+    }
+
+    // Out of budget before an instruction: pc is that instruction, the registers written before it are stored
+    // with the ones still holding what was loaded
+    unsigned char *outOfBudget = buffer + e.pos;
+    e.byte(0x49), e.byte(0xFF), e.byte(0xC7); // inc r15
+    writeBack(used_registers);
+    e.patch(e.jump(), epilogue);
+
+    for (int i = 0; i < count; i++) {
+        e.patch(budgetExits[i], buffer + e.pos);
+        e.storeWordImm(CONTEXT_PC, start + i * 2);
+        e.patch(e.jump(), outOfBudget);
+    }
+
+    chip8JitBlock &block = blocks[start];
+    block = {entry, nullptr, (unsigned short) (count * 2), {}, 0};
+
+    // Each exit gets a stub returning to the interpreter, and jumps straight to the block of its target when
+    // there is one
+    for (int i = 0; i < exitCount; i++) {
+        unsigned short target = exits[i].target;
+        unsigned char *stub = buffer + e.pos;
+
+        e.patch(exits[i].displacement, stub);
+        e.storeWordImm(CONTEXT_PC, target);
+        e.patch(e.jump(), epilogue);
+
+        if (target < CHIP_8_JIT_ADDRESSES) {
+            links[target].push_back({exits[i].displacement, stub});
+            block.exits[block.exitCount++] = target;
+            if (blocks[target].code && blocks[target].code != &uncompilable)
+                e.patch(exits[i].displacement, blocks[target].code);
+        }
+    }
+
+    // Blocks leaving to this address, this one included, now jump straight to it
+    for (const chip8JitLink &link : links[start])
+        e.patch(link.displacement, entry);
+
+    for (int i = 0; i < count * 2; i++)
+        covered[start + i]++;
+    used = e.pos;
+    block.end = buffer + used;
+
+    return entry;
+}
+
+unsigned int chip8Jit::run(chip8 &c, unsigned int budget) {
+    if (!buffer || c.pc >= CHIP_8_JIT_ADDRESSES)
+        return 0;
+
+    unsigned char *block = blocks[c.pc].code;
+    if (!block)
+        block = compile(c, c.pc);
+    if (!block || block == &uncompilable)
+        return 0;
+
+    chip8JitContext context;
+    memcpy(context.V, c.V, CHIP_8_REGISTER);
+    context.I = c.I;
+    context.pc = c.pc;
+
+    long long remaining = enter(&context, block, budget);
+
+    memcpy(c.V, context.V, CHIP_8_REGISTER);
+    c.I = context.I;
+    c.pc = context.pc;
+
+    return budget - remaining;
+}
+
+void chip8Jit::drop(unsigned short start) {
+    chip8JitBlock &block = blocks[start];
+
+    for (int i = 0; i < block.length; i++)
+        covered[start + i]--;
+
+    if (block.code != &uncompilable) {
+        emitter e{buffer, 0};
+
+        // Jumps to the block go back to their stub
+        for (const chip8JitLink &link : links[start])
+            e.patch(link.displacement, link.stub);
+
+        // and the jumps of the block, left in the buffer until the next flush, are forgotten
+        size_t begin = block.code - buffer;
+        size_t end = block.end - buffer;
+        for (int i = 0; i < block.exitCount; i++)
+            std::erase_if(links[block.exits[i]], [&](const chip8JitLink &link) {
+                return link.displacement >= begin && link.displacement < end;
+            });
+    }
+
+    block = {};
+}
+
+void chip8Jit::invalidate(unsigned short address, unsigned short length) {
+    for (int i = 0; i < length; i++) {
+        int written = (address + i) & (CHIP_8_JIT_ADDRESSES - 1);
+        if (!covered[written])
+            continue;
+
+        // Only the blocks translating the written byte are dropped, they start at most a block length before it
+        for (int start = std::max(0, written - CHIP_8_JIT_MAX_BLOCK * 2 + 1); start <= written; start++)
+            if (blocks[start].code && start + blocks[start].length > written)
+                drop(start);
+    }
+}
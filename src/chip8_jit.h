@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#define CHIP_8_JIT_BUFFER_SIZE (4 * 1024 * 1024)
+#define CHIP_8_JIT_MAX_BLOCK 64
+#define CHIP_8_JIT_ADDRESSES 4096
+
+class chip8;
+
+// Guest state read and written by the compiled blocks
+struct chip8JitContext {
+    unsigned char V[16];
+    unsigned short I;
+    unsigned short pc;
+};
+
+// Translation of the instructions starting at one address
+struct chip8JitBlock {
+    // Native code, nullptr if not compiled yet, or a marker if the first instruction is not translated
+    unsigned char *code;
+    // End of the native code, exit stubs included
+    unsigned char *end;
+    // Bytes of guest memory translated
+    unsigned short length;
+    // Addresses the block may leave to
+    unsigned short exits[2];
+    unsigned char exitCount;
+};
+
+// Jump of a block to another address, and the stub it takes while no block is compiled there
+struct chip8JitLink {
+    size_t displacement;
+    unsigned char *stub;
+};
+
+// x86-64 recompiler of straight-line runs of instructions
+//
+// A block ends at a jump or a skip, or before any instruction it does not translate (calls, draws, memory,
+// timers, keys...), which the interpreter then executes. While a block runs, the V registers it uses and I live
+// in host registers, pc is a constant of the generated code. Blocks jump directly to each other once their
+// target is compiled. The remaining instruction budget is kept in r15 and taken one by one before each
+// instruction, a block runs out of it at the exact pc the interpreter has to carry on from.
+class chip8Jit {
+private:
+    typedef long long (*entryPoint)(chip8JitContext *context, const unsigned char *block, long long budget);
+
+    unsigned char *buffer = nullptr;
+    size_t used = 0;
+
+    entryPoint enter = nullptr;
+    unsigned char *epilogue = nullptr;
+
+    // Block starting at each address
+    chip8JitBlock blocks[CHIP_8_JIT_ADDRESSES];
+    // Number of blocks translating each byte of guest memory
+    unsigned char covered[CHIP_8_JIT_ADDRESSES];
+    // Jumps of the blocks to each address, linked to the block compiled there if any
+    std::vector<chip8JitLink> links[CHIP_8_JIT_ADDRESSES];
+
+    unsigned char *compile(chip8 &c, unsigned short start);
+    void drop(unsigned short start);
+    void emitPrologue();
+
+public:
+    chip8Jit();
+    ~chip8Jit();
+
+    chip8Jit(const chip8Jit &) = delete;
+    chip8Jit &operator=(const chip8Jit &) = delete;
+
+    // Runs compiled blocks from the current pc, returns the number of instructions executed (0 if none could be)
+    unsigned int run(chip8 &c, unsigned int budget);
+    // Drops the translations of a written memory range
+    void invalidate(unsigned short address, unsigned short length);
+    void flush();
+};
@@ -0,0 +1,164 @@
+//
+// Frame history of a chip8 kept as run-length encoded XOR deltas
+//
+
+#include "chip8_rewind.h"
+
+// A run header: zero bytes skipped, then changed bytes copied
+struct chip8RewindRun {
+    uint16_t skip;
+    uint16_t copy;
+};
+
+static_assert(sizeof(chip8State) <= UINT16_MAX, "Runs of a rewind delta count bytes of a state in 16 bits");
+
+// Worst case of a delta, every changed run ends on a gap of CHIP_8_REWIND_MIN_GAP zeros and costs a header
+#define CHIP_8_REWIND_MAX_DELTA (sizeof(chip8State) + \
+        (sizeof(chip8State) / (CHIP_8_REWIND_MIN_GAP + 1) + 1) * sizeof(chip8RewindRun))
+
+// Encodes the XOR of two states to out, returns its length
+static size_t encodeDelta(const unsigned char *a, const unsigned char *b, unsigned char *out) {
+    size_t length = 0;
+    size_t i = 0;
+
+    while (i < sizeof(chip8State)) {
+        size_t start = i;
+        while (i < sizeof(chip8State) && a[i] == b[i])
+            i++;
+        if (i == sizeof(chip8State))
+            break;
+
+        // The run goes on until a long enough gap of unchanged bytes or the end of the state
+        size_t first = i;
+        size_t end = i;
+        while (end < sizeof(chip8State)) {
+            if (a[end] != b[end]) {
+                i = ++end;
+                continue;
+            }
+            if (end - i + 1 >= CHIP_8_REWIND_MIN_GAP)
+                break;
+            end++;
+        }
+
+        chip8RewindRun run = {(uint16_t) (first - start), (uint16_t) (i - first)};
+        memcpy(out + length, &run, sizeof(run));
+        length += sizeof(run);
+
+        for (size_t j = first; j < i; j++)
+            out[length++] = a[j] ^ b[j];
+    }
+
+    return length;
+}
+
+// XORs a delta into a state, which goes from one side of the delta to the other
+static void applyDelta(const unsigned char *in, size_t length, unsigned char *state) {
+    size_t offset = 0;
+
+    for (size_t i = 0; i < length;) {
+        chip8RewindRun run;
+        memcpy(&run, in + i, sizeof(run));
+        i += sizeof(run);
+
+        offset += run.skip;
+        for (unsigned int j = 0; j < run.copy; j++)
+            state[offset++] ^= in[i++];
+    }
+}
+
+chip8Rewind::chip8Rewind(unsigned int frames, size_t bufferSize) : buffer(bufferSize), deltas(frames ? frames : 1) {
+}
+
+void chip8Rewind::dropOldest() {
+    usedBytes -= deltas[oldest].length;
+    oldest = (oldest + 1) % deltas.size();
+    count--;
+}
+
+void chip8Rewind::record(const chip8 &c) {
+    chip8State state;
+    c.snapshot(state);
+
+    if (!hasLatest) {
+        latest = state;
+        hasLatest = true;
+        return;
+    }
+
+    unsigned char encoded[CHIP_8_REWIND_MAX_DELTA];
+    size_t length = encodeDelta((const unsigned char *) &state, (const unsigned char *) &latest, encoded);
+    latest = state;
+
+    if (length > buffer.size()) {
+        clear();
+        latest = state;
+        hasLatest = true;
+        return;
+    }
+
+    if (count == deltas.size())
+        dropOldest();
+
+    // A delta is never split, the end of the buffer is left unused when it does not fit there. The deltas left
+    // there are the oldest ones.
+    if (writeOffset + length > buffer.size()) {
+        while (count > 0 && deltas[oldest].offset >= writeOffset)
+            dropOldest();
+        writeOffset = 0;
+    }
+
+    // The deltas from writeOffset on are older than the ones before it, oldest first
+    while (count > 0 && deltas[oldest].offset >= writeOffset && deltas[oldest].offset < writeOffset + length)
+        dropOldest();
+
+    memcpy(buffer.data() + writeOffset, encoded, length);
+    deltas[(oldest + count) % deltas.size()] = {writeOffset, (uint32_t) length};
+    count++;
+
+    writeOffset += length;
+    usedBytes += length;
+    recordedBytes += length;
+    recordedDeltas++;
+}
+
+bool chip8Rewind::stepBack(chip8 &c) {
+    if (count == 0)
+        return false;
+
+    const delta &newest = deltas[(oldest + count - 1) % deltas.size()];
+    applyDelta(buffer.data() + newest.offset, newest.length, (unsigned char *) &latest);
+
+    // The newest delta was the last one written, its bytes are free again
+    writeOffset = newest.offset;
+    usedBytes -= newest.length;
+    count--;
+
+    c.restore(latest);
+    return true;
+}
+
+void chip8Rewind::clear() {
+    writeOffset = 0;
+    oldest = 0;
+    count = 0;
+    usedBytes = 0;
+    hasLatest = false;
+}
+
+unsigned int chip8Rewind::frames() const {
+    return count;
+}
+
+size_t chip8Rewind::memoryUsed() const {
+    return usedBytes + sizeof(latest) + deltas.size() * sizeof(delta);
+}
+
+void chip8Rewind::printStats(FILE *out) const {
+    double average = recordedDeltas ? (double) recordedBytes / recordedDeltas : 0.0;
+
+    fprintf(out, "rewind %zu frames (%.1f s) in %zu bytes, %.1f bytes per frame, %.1f KB per second of history "
+                 "(%zu KB buffer, %.1f s at this rate)\n", count, (double) count / CHIP_8_FRAME_RATE, memoryUsed(),
+            average, average * CHIP_8_FRAME_RATE / 1024, buffer.size() / 1024,
+            average > 0 ? buffer.size() / average / CHIP_8_FRAME_RATE : 0.0);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chip8.h"
+
+#define CHIP_8_REWIND_BUFFER_SIZE (4 * 1024 * 1024)
+// Zero bytes that end a run of changed bytes in a delta, shorter gaps are cheaper to copy than to start a new run
+#define CHIP_8_REWIND_MIN_GAP 4
+
+// History of the last frames of a chip8, to step back through them one frame at a time
+//
+// Only the latest state is kept whole. Each frame recorded before it is a delta: the XOR of the state with the one
+// that followed it, run-length encoded as (zero bytes to skip, changed bytes to copy) pairs. Usually a few registers,
+// the timers and some rows of the screen change in a frame, so a delta is tens of bytes where a state is 4456. Stepping
+// back XORs the latest delta into the latest state, which costs the size of that delta whatever the history holds.
+//
+// Deltas are stored one after the other in a ring of bytes, a new one overwrites the oldest when the ring is full.
+class chip8Rewind {
+private:
+    struct delta {
+        size_t offset;
+        uint32_t length;
+    };
+
+    std::vector<unsigned char> buffer;
+    // Next byte of buffer to write
+    size_t writeOffset = 0;
+
+    // Ring of the deltas, oldest first
+    std::vector<delta> deltas;
+    size_t oldest = 0;
+    size_t count = 0;
+
+    // State of the latest frame recorded
+    chip8State latest;
+    bool hasLatest = false;
+
+    // Encoded size of the deltas in the ring and of every delta ever recorded
+    size_t usedBytes = 0;
+    unsigned long long recordedBytes = 0;
+    unsigned long long recordedDeltas = 0;
+
+    void dropOldest();
+
+public:
+    // Keeps up to frames frames, fewer if their deltas do not fit in bufferSize bytes
+    explicit chip8Rewind(unsigned int frames, size_t bufferSize = CHIP_8_REWIND_BUFFER_SIZE);
+
+    // Records the state of the machine, once per frame
+    void record(const chip8 &c);
+    // Puts the machine back in the state recorded before the latest one and forgets the latest, returns false when
+    // there is no earlier state
+    bool stepBack(chip8 &c);
+    // Forgets every frame
+    void clear();
+
+    // Frames the machine can step back
+    unsigned int frames() const;
+    // Bytes held by the deltas, the latest state and the ring of deltas
+    size_t memoryUsed() const;
+    // Prints the frames held and the memory per second of history
+    void printStats(FILE *out) const;
+};
@@ -0,0 +1,60 @@
+//
+// Games mapped from their file
+//
+
+#include "chip8_rom.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+chip8Rom::~chip8Rom() {
+    close();
+}
+
+chip8LoadError chip8Rom::open(const char *path) {
+    close();
+
+    int file = ::open(path, O_RDONLY);
+    if (file < 0)
+        return CHIP_8_LOAD_CANNOT_OPEN;
+
+    struct stat status;
+    if (fstat(file, &status) != 0 || !S_ISREG(status.st_mode)) {
+        ::close(file);
+        return CHIP_8_LOAD_CANNOT_READ;
+    }
+
+    if (status.st_size == 0) {
+        ::close(file);
+        return CHIP_8_LOAD_EMPTY;
+    }
+    if (status.st_size > CHIP_8_MAX_GAME_SIZE) {
+        ::close(file);
+        return CHIP_8_LOAD_TOO_LARGE;
+    }
+
+    // The mapping stays valid once the file is closed
+    void *mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+
+    if (mapped == MAP_FAILED)
+        return CHIP_8_LOAD_CANNOT_READ;
+
+    data = (const unsigned char *) mapped;
+    size = status.st_size;
+    return CHIP_8_LOAD_OK;
+}
+
+void chip8Rom::close() {
+    if (data)
+        munmap((void *) data, size);
+
+    data = nullptr;
+    size = 0;
+}
+
+std::span<const unsigned char> chip8Rom::bytes() const {
+    return {data, size};
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+#include "chip8.h"
+
+// File of a game mapped read-only in memory
+//
+// Any number of instances load it with chip8::loadGame(rom.bytes()), a single copy from the page cache to the memory of
+// each instance, the file itself is only opened and mapped once.
+class chip8Rom {
+private:
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+public:
+    chip8Rom() = default;
+    chip8Rom(const chip8Rom &) = delete;
+    chip8Rom &operator=(const chip8Rom &) = delete;
+    ~chip8Rom();
+
+    // Maps a game, in place of the one mapped before. Files too large to be a game are refused without mapping them.
+    chip8LoadError open(const char *path);
+    void close();
+
+    // Bytes of the game, empty until a game is mapped
+    std::span<const unsigned char> bytes() const;
+};
@@ -0,0 +1,56 @@
+//
+// Run-ahead of a chip8 on a hidden copy
+//
+
+#include "chip8_runahead.h"
+
+#include <chrono>
+
+chip8RunAhead::chip8RunAhead(unsigned int frames) : frames(frames) {
+    ahead.initialize();
+    ahead.soundEnabled = false;
+}
+
+chip8RunResult chip8RunAhead::runFrame(chip8 &c) {
+    auto start = std::chrono::steady_clock::now();
+
+    chip8RunResult result = c.runFrames(1);
+
+    auto real = std::chrono::steady_clock::now();
+
+    // The settings come first, restore checks the state against cyclesPerFrame
+    ahead.cyclesPerFrame = c.cyclesPerFrame;
+    ahead.clipSprites = c.clipSprites;
+    ahead.waitVblank = c.waitVblank;
+
+    // A state the copy refuses leaves it where it was, the real machine is shown for this frame instead
+    c.snapshot(state);
+    if (ahead.restore(state)) {
+        ahead.runFrames(frames);
+        shown = &ahead;
+    } else
+        shown = &c;
+
+    auto end = std::chrono::steady_clock::now();
+
+    realNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(real - start).count();
+    aheadNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - real).count();
+    runs++;
+
+    return result;
+}
+
+const chip8 &chip8RunAhead::speculative() const {
+    return *shown;
+}
+
+void chip8RunAhead::printStats(FILE *out) const {
+    if (runs == 0)
+        return;
+
+    double real = (double) realNanoseconds / runs / 1000;
+    double extra = (double) aheadNanoseconds / runs / 1000;
+
+    fprintf(out, "run-ahead %u frames: %.2f us per real frame, %.2f us more to run ahead (+%.0f%%)\n", frames, real,
+            extra, real > 0 ? 100 * extra / real : 0.0);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdio>
+
+#include "chip8.h"
+
+// Shows the frames a game will draw a few frames from now, to hide the frames of lag between a key press and the
+// screen
+//
+// Each real frame is followed by a run of a hidden copy of the machine, restored from a snapshot taken at the end of
+// the frame and run some frames further with the keys held now. The copy's screen is the one shown, the real machine
+// carries on from where it was, so the speculative frames never change the game.
+class chip8RunAhead {
+private:
+    chip8 ahead;
+    chip8State state;
+    // Machine whose screen runFrame left to show, the real one when the copy could not be restored
+    const chip8 *shown = &ahead;
+
+    unsigned int frames;
+
+    // Time spent in the real frames and in the snapshot, restore and speculative frames after them
+    unsigned long long realNanoseconds = 0;
+    unsigned long long aheadNanoseconds = 0;
+    unsigned long long runs = 0;
+
+public:
+    // Runs frames frames ahead of the real machine
+    explicit chip8RunAhead(unsigned int frames);
+
+    // Runs a frame of c, then frames more on the hidden copy
+    chip8RunResult runFrame(chip8 &c);
+    // Hidden copy, its screen is the one to show after runFrame, or the real machine if the copy could not follow it
+    const chip8 &speculative() const;
+
+    // Prints the time the speculative frames add to each real one
+    void printStats(FILE *out) const;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef CHIP_8_TRACE
+#include <algorithm>
+#include <bit>
+#include <vector>
+#endif
+
+// Entries kept by a trace unless told otherwise, 32 MB
+#define CHIP_8_TRACE_SIZE (1 << 22)
+#define CHIP_8_TRACE_MAGIC 0x52543843 // "C8TR" in the first four bytes of a trace file
+#define CHIP_8_TRACE_VERSION 1
+
+#ifdef CHIP_8_TRACE
+constexpr bool chip8Tracing = true;
+#else
+constexpr bool chip8Tracing = false;
+#endif
+
+// One instruction run by the interpreter, with the registers it may have changed
+//
+// X is the second nibble of the opcode, so V[X] and VF after the instruction cover every register an instruction writes
+// but V0 to V[X-1] of FX65. Which of them changed depends on the opcode, chip8-trace works it out when decoding.
+struct chip8TraceEntry {
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t I; // I after the instruction
+    uint8_t VX; // V[X] after the instruction
+    uint8_t VF; // VF after the instruction
+};
+
+static_assert(sizeof(chip8TraceEntry) == 8, "chip8TraceEntry must not have padding");
+
+// Start of a trace file, followed by count entries, oldest first, in the byte order of the host
+struct chip8TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    // Instructions recorded since the trace started, the file only holds the last count of them
+    uint64_t recorded;
+    uint64_t count;
+};
+
+static_assert(sizeof(chip8TraceHeader) == 24, "chip8TraceHeader must not have padding");
+
+// Ring of the last instructions run by a chip8, when built with CHIP_8_TRACE
+template<bool enabled>
+struct chip8Trace;
+
+// Without CHIP_8_TRACE there is nothing to record, the calls to the trace compile to nothing
+template<>
+struct chip8Trace<false> {
+    void clear() {}
+    void start(size_t entries) {}
+    void record(uint16_t pc, uint16_t opcode, uint16_t I, uint8_t VX, uint8_t VF) {}
+};
+
+#ifdef CHIP_8_TRACE
+template<>
+struct chip8Trace<true> {
+    // A power of two long, so that the next entry is found with a mask. Until the trace is started it is a single entry
+    // rewritten by every instruction, recording never has to check whether it is on.
+    std::vector<chip8TraceEntry> ring = std::vector<chip8TraceEntry>(1);
+    uint64_t mask = 0;
+    // Instructions recorded, the next one goes to ring[head & mask]
+    uint64_t head = 0;
+
+    void clear() {
+        head = 0;
+    }
+
+    // Keeps the last entries instructions, rounded up to a power of two
+    void start(size_t entries) {
+        size_t size = std::bit_ceil(std::max<size_t>(entries, 1));
+
+        ring.assign(size, chip8TraceEntry{});
+        mask = size - 1;
+        head = 0;
+    }
+
+    void record(uint16_t pc, uint16_t opcode, uint16_t I, uint8_t VX, uint8_t VF) {
+        ring[head & mask] = {pc, opcode, I, VX, VF};
+        head++;
+    }
+};
+#endif
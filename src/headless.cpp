@@ -0,0 +1,290 @@
+//
+// Runs a game without a window, as fast as possible
+//
+
+#include <bit>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "chip8_rewind.h"
+#include "chip8_runahead.h"
+
+chip8 myChip8;
+
+// Where the trace is written, at the end, on SIGUSR1 and on a crash
+const char *tracePath = NULL;
+
+// Only calls async-signal-safe functions, the trace is dumped with write
+void dumpTraceOnSignal(int signal) {
+    int fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        myChip8.dumpTrace(fd);
+        close(fd);
+    }
+
+    if (signal == SIGUSR1)
+        return;
+
+    // Crashes carry on to the default action, which ends the process
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+
+// FNV-1a hash of the screen
+unsigned long long hashScreen() {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    for (uint64_t row : myChip8.gfx) {
+        for (int byte = 0; byte < 8; byte++) {
+            hash ^= (row >> (byte * 8)) & 0xFF;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
+
+void usage() {
+    printf("Usage: chip8-headless chip8application [options]\n"
+           "\n"
+           "  --frames N            Frames to run (default 600)\n"
+           "  --cycles N            Instructions to run instead of a number of frames\n"
+           "  --cycles-per-frame N  Instructions per frame (default %d)\n"
+           "  --clip                Cuts sprites at the edges of the screen instead of wrapping them around\n"
+           "  --vblank              Ends the frame at each draw, the game waits for the vertical blank\n"
+           "  --seed N              Seed of the random numbers (default %d)\n"
+           "  --load-state FILE     Starts from a save state instead of the start of the game\n"
+           "  --save-state FILE     Saves the state reached at the end\n"
+           "  --rewind N            Records the last N seconds to rewind, then steps back through them at the end\n"
+           "  --run-ahead N         Runs N frames ahead on a hidden copy after each frame, and prints what it costs\n"
+           "  --hash N              Prints the hash of the screen every N frames\n"
+           "  --stats               Prints the rows changed per frame and the superinstruction statistics\n"
+           "  --profile             Prints the handlers and addresses the host time went to (CHIP_8_PROFILE builds)\n"
+           "  --profile-json FILE   Writes the whole profile to FILE as JSON\n"
+           "  --trace FILE          Writes the last instructions to FILE at the end, on SIGUSR1 and on a crash, for\n"
+           "                        chip8-trace to decode (CHIP_8_TRACE builds)\n"
+           "  --trace-size N        Instructions kept in the trace (default %d)\n"
+           "\n", CHIP_8_CYCLES_PER_FRAME, CHIP_8_RANDOM_SEED, CHIP_8_TRACE_SIZE);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    unsigned long long frames = 600;
+    unsigned long long cycles = 0;
+    unsigned int cyclesPerFrame = CHIP_8_CYCLES_PER_FRAME;
+    bool clip = false;
+    bool vblank = false;
+    unsigned long long seed = CHIP_8_RANDOM_SEED;
+    const char *loadPath = NULL;
+    const char *savePath = NULL;
+    unsigned int rewindSeconds = 0;
+    unsigned int runAheadFrames = 0;
+    unsigned long long hashEvery = 0;
+    bool stats = false;
+    bool profile = false;
+    const char *profilePath = NULL;
+    size_t traceSize = CHIP_8_TRACE_SIZE;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+            cycles = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cycles-per-frame") == 0 && i + 1 < argc)
+            cyclesPerFrame = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--clip") == 0)
+            clip = true;
+        else if (strcmp(argv[i], "--vblank") == 0)
+            vblank = true;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+            loadPath = argv[++i];
+        else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc)
+            savePath = argv[++i];
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc)
+            rewindSeconds = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+            runAheadFrames = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc)
+            hashEvery = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile = true;
+        else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc)
+            profilePath = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc)
+            traceSize = strtoull(argv[++i], NULL, 10);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (cyclesPerFrame == 0) {
+        usage();
+        return 1;
+    }
+
+    if (tracePath && !chip8Tracing) {
+        fprintf(stderr, "This build has no trace, configure with -DCHIP_8_TRACE=ON\n");
+        return 1;
+    }
+
+    myChip8.initialize();
+
+    chip8LoadError error = myChip8.loadGame(argv[1]);
+    if (error != CHIP_8_LOAD_OK) {
+        fprintf(stderr, "Cannot load %s: %s\n", argv[1], chip8LoadErrorString(error));
+        return 1;
+    }
+    myChip8.cyclesPerFrame = cyclesPerFrame;
+    myChip8.soundEnabled = false;
+    myChip8.clipSprites = clip;
+    myChip8.waitVblank = vblank;
+    myChip8.seedRandom(seed);
+
+    if (loadPath && !myChip8.loadState(loadPath)) {
+        fprintf(stderr, "Cannot load the save state %s\n", loadPath);
+        return 1;
+    }
+
+    if (tracePath) {
+        myChip8.startTrace(traceSize);
+        for (int signal : {SIGUSR1, SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT})
+            std::signal(signal, dumpTraceOnSignal);
+    }
+
+    // A budget in instructions is run as whole frames, then a last one cut short
+    unsigned int remainder = 0;
+    if (cycles > 0) {
+        frames = cycles / cyclesPerFrame;
+        remainder = cycles % cyclesPerFrame;
+    }
+
+    std::unique_ptr<chip8Rewind> history;
+    if (rewindSeconds > 0) {
+        history = std::make_unique<chip8Rewind>(rewindSeconds * CHIP_8_FRAME_RATE);
+        history->record(myChip8);
+    }
+
+    std::unique_ptr<chip8RunAhead> runAhead;
+    if (runAheadFrames > 0)
+        runAhead = std::make_unique<chip8RunAhead>(runAheadFrames);
+
+    unsigned long long frame = 0;
+    unsigned long long executed = 0;
+    unsigned long long dirtyRows = 0;
+    bool stopped = false;
+    auto start = std::chrono::steady_clock::now();
+
+    // Nobody presses keys here, a frame waiting for one just ends early
+    while (frame < frames) {
+        unsigned long long chunk = frames - frame;
+        if (hashEvery > 0 && hashEvery - frame % hashEvery < chunk)
+            chunk = hashEvery - frame % hashEvery;
+        if (chunk > UINT_MAX)
+            chunk = UINT_MAX;
+        // The rows a renderer would upload are counted once per frame, and the history and run-ahead work per frame
+        if (stats || history || runAhead)
+            chunk = 1;
+
+        chip8RunResult result = runAhead ? runAhead->runFrame(myChip8) : myChip8.runFrames(chunk);
+        executed += result.cycles;
+        frame += result.frames;
+
+        dirtyRows += std::popcount(myChip8.dirtyRows);
+        myChip8.dirtyRows = 0;
+
+        if (history)
+            history->record(myChip8);
+
+        if (result.reason == CHIP_8_STOP_ILLEGAL) {
+            stopped = true;
+            break;
+        }
+
+        if (hashEvery > 0 && frame % hashEvery == 0)
+            printf("frame %llu %016llx\n", frame, hashScreen());
+    }
+
+    if (remainder > 0 && !stopped) {
+        chip8RunResult result = myChip8.runCycles(remainder);
+        executed += result.cycles;
+        stopped = result.reason == CHIP_8_STOP_ILLEGAL;
+        myChip8.tickTimers();
+        frame++;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("frames %llu instructions %llu time %.3f s (%.1f million instructions/s, %.0f frames/s)\n",
+           frame, executed, seconds, executed / seconds / 1e6, frame / seconds);
+    printf("screen %016llx\n", hashScreen());
+    if (stopped)
+        printf("stopped on an unknown opcode\n");
+
+    if (savePath && !myChip8.saveState(savePath)) {
+        fprintf(stderr, "Cannot write the save state %s\n", savePath);
+        return 1;
+    }
+
+    if (tracePath) {
+        if (!myChip8.dumpTrace(tracePath)) {
+            fprintf(stderr, "Cannot write the trace %s\n", tracePath);
+            return 1;
+        }
+        printf("trace written to %s\n", tracePath);
+    }
+
+    if (runAhead)
+        runAhead->printStats(stdout);
+
+    if (history) {
+        history->printStats(stdout);
+
+        unsigned int steps = 0;
+        auto rewindStart = std::chrono::steady_clock::now();
+        while (history->stepBack(myChip8))
+            steps++;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - rewindStart).count();
+
+        printf("stepped back %u frames in %.3f ms (%.2f us per frame), screen %016llx\n", steps, elapsed * 1e3,
+               steps ? elapsed * 1e6 / steps : 0.0, hashScreen());
+    }
+
+    if (stats) {
+        printf("rows changed per frame %.2f of %d\n", frame ? (double) dirtyRows / frame : 0.0, CHIP_8_SCREEN_HEIGHT);
+        myChip8.printFusionStats(stdout);
+    }
+
+    if (profile)
+        myChip8.printProfile(stdout);
+
+    if (profilePath) {
+        FILE *out = fopen(profilePath, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot write %s\n", profilePath);
+            return 1;
+        }
+
+        myChip8.dumpProfile(out);
+        fclose(out);
+    }
+
+    return 0;
+}
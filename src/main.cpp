@@ -1,32 +1,201 @@
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <memory>
 #include <string>
-#include <unistd.h>
+#include <thread>
+#include <vector>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
 #include "chip8.h"
+#include "chip8_rewind.h"
+#include "chip8_runahead.h"
+#include "scheduler.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
 
 #define PIXEL_SIZE 20
 
+// Key events the emulation thread has not taken yet
+#define INPUT_QUEUE_SIZE 256
+// Buckets of the input latency histogram, bucket b counts latencies from 2^b to 2^(b+1) microseconds
+#define INPUT_LATENCY_BUCKETS 24
+// Key events past the 16 keys of the keypad, for the emulator itself
+#define HOST_KEY_REWIND 16
+// Seconds of history kept to rewind
+#define REWIND_SECONDS 60
+
+// Screen rows as uploaded to the texture, two 32 bit words per row with the leftmost pixel in the top bit of the first
+#define SCREEN_ROW_WORDS 2
+
+void parseColour(const char *hex, GLfloat *colour);
+
 void setupGraphics();
 
+// Screen published by the emulation thread
+struct screenFrame {
+    uint64_t gfx[CHIP_8_SCREEN_HEIGHT];
+    // Rows changed since the screen the main thread took before this one, bit y for row y
+    uint32_t dirtyRows;
+    // Frames emulated before this screen
+    unsigned long long frame;
+};
+
+// Key pressed or released on the keyboard, with the time GLFW reported it
+struct keyEvent {
+    std::chrono::steady_clock::time_point time;
+    unsigned char key;
+    bool pressed;
+};
+
+// CHIP-8 key or HOST_KEY_* of each GLFW key, -1 for the keys not mapped
+struct keyMap {
+    signed char keys[GLFW_KEY_LAST + 1];
+};
+
+// The 4x4 block from 1 to V stands for the hexadecimal keypad:
+//   1 2 3 4      1 2 3 C
+//   Q W E R  ->  4 5 6 D
+//   A S D F      7 8 9 E
+//   Z X C V      A 0 B F
+constexpr keyMap buildKeyMap() {
+    keyMap map{};
+
+    for (signed char &key : map.keys)
+        key = -1;
+
+    map.keys[GLFW_KEY_1] = 0x1;
+    map.keys[GLFW_KEY_2] = 0x2;
+    map.keys[GLFW_KEY_3] = 0x3;
+    map.keys[GLFW_KEY_4] = 0xC;
+
+    map.keys[GLFW_KEY_Q] = 0x4;
+    map.keys[GLFW_KEY_W] = 0x5;
+    map.keys[GLFW_KEY_E] = 0x6;
+    map.keys[GLFW_KEY_R] = 0xD;
+
+    map.keys[GLFW_KEY_A] = 0x7;
+    map.keys[GLFW_KEY_S] = 0x8;
+    map.keys[GLFW_KEY_D] = 0x9;
+    map.keys[GLFW_KEY_F] = 0xE;
+
+    map.keys[GLFW_KEY_Z] = 0xA;
+    map.keys[GLFW_KEY_X] = 0x0;
+    map.keys[GLFW_KEY_C] = 0xB;
+    map.keys[GLFW_KEY_V] = 0xF;
+
+    // Held down to go back in time, a frame per frame
+    map.keys[GLFW_KEY_BACKSPACE] = HOST_KEY_REWIND;
+
+    return map;
+}
+
+constexpr keyMap hostKeys = buildKeyMap();
+
 void setupInput();
 
-void drawGraphics();
+void emulate();
+
+void readInputs(std::vector<std::chrono::steady_clock::time_point> &pending);
+
+void printLatency();
+
+void publishScreen(const chip8 &source, unsigned long long frame);
 
-void readInputs();
+void drawGraphics(const screenFrame &screen, bool fresh);
 
 chip8 myChip8;
-GLubyte *pixels = new GLubyte[CHIP_8_SCREEN_HEIGHT * CHIP_8_SCREEN_WIDTH * 3];
+GLuint rows[CHIP_8_SCREEN_HEIGHT * SCREEN_ROW_WORDS];
+
+// The emulation thread runs myChip8 and publishes its screen, the main thread presents the latest one at each refresh
+tripleBuffer<screenFrame> screens;
+std::atomic<bool> running(true);
+
+// Filled by the GLFW callback on the main thread, drained by the emulation thread before each frame
+spscQueue<keyEvent, INPUT_QUEUE_SIZE> inputQueue;
+std::atomic<unsigned long long> droppedEvents(0);
+
+// Frames of the last REWIND_SECONDS, only touched by the emulation thread
+chip8Rewind history(REWIND_SECONDS * CHIP_8_FRAME_RATE);
+bool rewinding = false;
+
+// Set with --run-ahead, the screen shown is then the one of a hidden copy some frames ahead of myChip8
+std::unique_ptr<chip8RunAhead> runAhead;
+
+// Time from a key event to the first EX9E, EXA1 or FX0A run after it, only touched by the emulation thread
+unsigned long long latency[INPUT_LATENCY_BUCKETS];
+
+// Colours of the lit and unlit pixels, applied by the fragment shader
+GLfloat foreground[3] = {1.0f, 1.0f, 1.0f};
+GLfloat background[3] = {0.0f, 0.0f, 0.0f};
 
 GLuint shaderProgram;
 GLFWwindow *window;
 GLuint VAO, VBO, EBO;
 GLuint texture;
 
+// Texture uploads, to check how much the dirty rows save over uploading the whole screen
+unsigned long long uploadedBytes = 0;
+unsigned long long uploadCalls = 0;
+unsigned long long presentedFrames = 0;
+unsigned long long shownScreens = 0;
+std::atomic<unsigned long long> emulatedFrames(0);
+std::atomic<unsigned long long> publishedScreens(0);
+
+void usage() {
+    printf("Usage: CHIP_8 chip8application [options]\n"
+           "\n"
+           "  --cycles-per-frame N  Instructions per frame (default %d)\n"
+           "  --foreground RRGGBB   Colour of the pixels that are on\n"
+           "  --background RRGGBB   Colour of the pixels that are off\n"
+           "  --clip                Cuts sprites at the edges of the screen instead of wrapping them around\n"
+           "  --vblank              Ends the frame at each draw, the game waits for the vertical blank\n"
+           "  --seed N              Seed of the random numbers (default the time)\n"
+           "  --run-ahead N         Shows the screen N frames ahead to hide input lag\n"
+           "\n", CHIP_8_CYCLES_PER_FRAME);
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        printf("Usage: PROGRAM chip8application\n\n");
+        usage();
+        return 1;
+    }
+
+    myChip8.initialize();
+
+    chip8LoadError error = myChip8.loadGame(argv[1]);
+    if (error != CHIP_8_LOAD_OK) {
+        fprintf(stderr, "Cannot load %s: %s\n", argv[1], chip8LoadErrorString(error));
+        return 1;
+    }
+    // A different game every time, unless a seed is given to replay one
+    myChip8.seedRandom(time(NULL));
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--cycles-per-frame") == 0 && i + 1 < argc)
+            myChip8.cyclesPerFrame = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--foreground") == 0 && i + 1 < argc)
+            parseColour(argv[++i], foreground);
+        else if (strcmp(argv[i], "--background") == 0 && i + 1 < argc)
+            parseColour(argv[++i], background);
+        else if (strcmp(argv[i], "--clip") == 0)
+            myChip8.clipSprites = true;
+        else if (strcmp(argv[i], "--vblank") == 0)
+            myChip8.waitVblank = true;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            myChip8.seedRandom(strtoull(argv[++i], NULL, 10));
+        else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+            runAhead = std::make_unique<chip8RunAhead>(strtoul(argv[++i], NULL, 10));
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (myChip8.cyclesPerFrame == 0) {
+        usage();
         return 1;
     }
 
@@ -34,18 +203,22 @@ int main(int argc, char **argv) {
 
     setupInput();
 
-    myChip8.initialize();
-    myChip8.loadGame(argv[1]);
+    std::thread emulation(emulate);
 
+    // Presents at the refresh rate of the display, whatever the number of sprites the game draws
     while (!glfwWindowShouldClose(window)) {
-        myChip8.emulateCycle();
-
-        if (myChip8.drawFlag)
-            drawGraphics();
+        glfwPollEvents();
 
-        usleep(1 / 60 * 1000000);
+        // Without a new screen the texture is left as it is and only redrawn
+        bool fresh = screens.acquire();
+        if (fresh)
+            shownScreens++;
+        drawGraphics(screens.readSlot(), fresh);
     }
 
+    running = false;
+    emulation.join();
+
     // Destroy everything
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
@@ -55,11 +228,27 @@ int main(int argc, char **argv) {
     glfwDestroyWindow(window);
     glfwTerminate();
 
-    delete[] pixels;
+    printf("uploaded %llu bytes in %llu glTexSubImage2D calls over %llu presents (%.0f bytes per present, %d for the "
+           "whole screen)\n", uploadedBytes, uploadCalls, presentedFrames,
+           presentedFrames ? (double) uploadedBytes / presentedFrames : 0.0, (int) sizeof(rows));
+    printLatency();
+    history.printStats(stdout);
+    if (runAhead)
+        runAhead->printStats(stdout);
+    printf("emulated %llu frames, published %llu screens, presented %llu times showing %llu new screens\n",
+           emulatedFrames.load(), publishedScreens.load(), presentedFrames, shownScreens);
 
     return 0;
 }
 
+void parseColour(const char *hex, GLfloat *colour) {
+    unsigned long rgb = strtoul(hex, NULL, 16);
+
+    colour[0] = ((rgb >> 16) & 0xFF) / 255.0f;
+    colour[1] = ((rgb >> 8) & 0xFF) / 255.0f;
+    colour[2] = (rgb & 0xFF) / 255.0f;
+}
+
 void setupGraphics() {
     int width = CHIP_8_SCREEN_WIDTH * PIXEL_SIZE;
     int height = CHIP_8_SCREEN_HEIGHT * PIXEL_SIZE;
@@ -78,6 +267,8 @@ void setupGraphics() {
     if (window == NULL)
         throw "Failed to create GLFW window";
     glfwMakeContextCurrent(window);
+    // Presents block until the next refresh
+    glfwSwapInterval(1);
 
     // Load Glad
     gladLoadGL();
@@ -109,10 +300,15 @@ void setupGraphics() {
                                                 "in vec3 color;\n"
                                                 "in vec2 texCoord;\n"
                                                 "\n"
-                                                "uniform sampler2D tex0;\n"
+                                                "uniform usampler2D tex0;\n"
+                                                "uniform vec3 foreground;\n"
+                                                "uniform vec3 background;\n"
                                                 "\n"
                                                 "void main() {\n"
-                                                "    FragColor = texture(tex0, texCoord);\n"
+                                                "    ivec2 pixel = min(ivec2(texCoord * vec2(64.0f, 32.0f)), ivec2(63, 31));\n"
+                                                "    uint word = texelFetch(tex0, ivec2(pixel.x >> 5, pixel.y), 0).r;\n"
+                                                "    uint lit = (word >> uint(31 - (pixel.x & 31))) & 1u;\n"
+                                                "    FragColor = vec4(mix(background, foreground, float(lit)), 1.0f);\n"
                                                 "}";
 
         const char *vertexShaderSCodeCharA = vertexShaderSCodeString.c_str();
@@ -188,26 +384,119 @@ void setupGraphics() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 
-    // Clear screen
-    memset(pixels, 0, CHIP_8_SCREEN_WIDTH * CHIP_8_SCREEN_HEIGHT * 3 * sizeof(char));
+    // Clear screen, the texture holds the screen one bit per pixel
+    memset(rows, 0, sizeof(rows));
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, CHIP_8_SCREEN_WIDTH, CHIP_8_SCREEN_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE,
-                 (GLvoid *) pixels);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, SCREEN_ROW_WORDS, CHIP_8_SCREEN_HEIGHT, 0, GL_RED_INTEGER,
+                 GL_UNSIGNED_INT, (GLvoid *) rows);
     GLuint texUni = glGetUniformLocation(shaderProgram, "tex0");
     glUseProgram(shaderProgram);
     glUniform1i(texUni, 0);
+    glUniform3fv(glGetUniformLocation(shaderProgram, "foreground"), 1, foreground);
+    glUniform3fv(glGetUniformLocation(shaderProgram, "background"), 1, background);
 }
 
-void drawGraphics() {
-    // Update pixels
-    for (int y = 0; y < CHIP_8_SCREEN_HEIGHT; ++y) {
-        for (int x = 0; x < CHIP_8_SCREEN_WIDTH; ++x) {
-            pixels[y * CHIP_8_SCREEN_WIDTH * 3 + x * 3 + 0] = pixels[y * CHIP_8_SCREEN_WIDTH * 3 + x * 3 + 1] = pixels[
-                    y * CHIP_8_SCREEN_WIDTH * 3 + x * 3 + 2] = myChip8.gfx[y * CHIP_8_SCREEN_WIDTH + x] * 255;
+void emulate() {
+    scheduler frameScheduler(CHIP_8_FRAME_RATE);
+    unsigned long long frame = 0;
+
+    // Events applied to myChip8.key that no instruction has read yet
+    std::vector<std::chrono::steady_clock::time_point> pending;
+    pending.reserve(INPUT_QUEUE_SIZE);
+
+    while (running.load(std::memory_order_relaxed)) {
+        readInputs(pending);
+        // The first instruction reading the keys after these events times itself
+        if (!pending.empty())
+            myChip8.timeKeyRead = true;
+
+        // The keys held now are kept, not the ones held back then
+        if (rewinding) {
+            unsigned char held[16];
+            memcpy(held, myChip8.key, sizeof(held));
+
+            if (history.stepBack(myChip8)) {
+                memcpy(myChip8.key, held, sizeof(held));
+                publishScreen(myChip8, frame);
+            }
+
+            frameScheduler.waitNextFrame();
+            continue;
+        }
+
+        // The screen is latched once at the end of the frame, never half drawn
+        chip8RunResult result = runAhead ? runAhead->runFrame(myChip8) : myChip8.runFrames(1);
+
+        // The speculative screen may change even when the real one did not
+        if (runAhead)
+            publishScreen(runAhead->speculative(), frame);
+        else if (myChip8.drawFlag)
+            publishScreen(myChip8, frame);
+        history.record(myChip8);
+
+        // An instruction of this frame read the keys and took the time, the latency ends there
+        if (!pending.empty() && !myChip8.timeKeyRead) {
+            for (auto time : pending) {
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(myChip8.keyReadTime - time).count();
+                int bucket = (int) std::bit_width((unsigned long long) us | 1) - 1;
+                latency[std::min(bucket, INPUT_LATENCY_BUCKETS - 1)]++;
+            }
+            pending.clear();
+        }
+
+        frame += result.frames;
+        emulatedFrames.store(frame, std::memory_order_relaxed);
+
+        frameScheduler.waitNextFrame();
+    }
+}
+
+void publishScreen(const chip8 &source, unsigned long long frame) {
+    // Rows changed since the last screen the main thread took, only touched by the emulation thread
+    static uint32_t unshownRows = 0;
+
+    // A screen still unread when the next one is published is skipped, its rows are carried over to the next one. If
+    // the main thread takes it in the meantime, the next one only uploads a few rows more than needed.
+    if (!screens.unread())
+        unshownRows = 0;
+    unshownRows |= source.dirtyRows;
+
+    screenFrame &screen = screens.writeSlot();
+
+    memcpy(screen.gfx, source.gfx, sizeof(screen.gfx));
+    screen.dirtyRows = unshownRows;
+    screen.frame = frame;
+    screens.publish();
+    publishedScreens.fetch_add(1, std::memory_order_relaxed);
+
+    myChip8.drawFlag = false;
+    myChip8.dirtyRows = 0;
+}
+
+void drawGraphics(const screenFrame &screen, bool fresh) {
+    // The rows the game drew since the screen in the texture, skipped screens included
+    uint32_t dirty = fresh ? screen.dirtyRows : 0;
+
+    // Only the changed rows are uploaded, in runs of consecutive rows
+    while (dirty != 0) {
+        int first = std::countr_zero(dirty);
+        int count = std::countr_one(dirty >> first);
+
+        for (int y = first; y < first + count; ++y) {
+            rows[y * SCREEN_ROW_WORDS] = screen.gfx[y] >> 32;
+            rows[y * SCREEN_ROW_WORDS + 1] = (GLuint) screen.gfx[y];
         }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, SCREEN_ROW_WORDS, count, GL_RED_INTEGER, GL_UNSIGNED_INT,
+                        (GLvoid *) (rows + first * SCREEN_ROW_WORDS));
+
+        uploadedBytes += count * sizeof(GLuint) * SCREEN_ROW_WORDS;
+        uploadCalls++;
+
+        // count can be 32, the whole mask, which cannot be shifted out in one go
+        dirty &= ~(uint32_t) (((uint64_t) 1 << (first + count)) - 1);
     }
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, CHIP_8_SCREEN_WIDTH, CHIP_8_SCREEN_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE,
-                 (GLvoid *) pixels);
+    presentedFrames++;
 
     // Update GLFW
     glClearColor(.0f, .0f, .0f, 1.0f);
@@ -220,54 +509,57 @@ void drawGraphics() {
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
     glfwSwapBuffers(window);
+}
 
-    glfwPollEvents();
+void readInputs(std::vector<std::chrono::steady_clock::time_point> &pending) {
+    // A key pressed and released before the frame ran stays down for that frame, the release waits for the next one
+    uint32_t changed = 0;
+    const keyEvent *event;
 
-    myChip8.drawFlag = false;
+    while ((event = inputQueue.peek()) != nullptr) {
+        if (changed & (1 << event->key))
+            break;
+
+        changed |= 1 << event->key;
+        if (event->key == HOST_KEY_REWIND) {
+            rewinding = event->pressed;
+            inputQueue.pop();
+            continue;
+        }
+
+        myChip8.key[event->key] = event->pressed;
+        // A game that never reads the keys would let them pile up
+        if (pending.size() < INPUT_QUEUE_SIZE)
+            pending.push_back(event->time);
+        inputQueue.pop();
+    }
+}
+
+void printLatency() {
+    unsigned long long total = 0;
+    for (unsigned long long count : latency)
+        total += count;
+
+    if (total == 0)
+        return;
+
+    printf("input latency, from the key event to the first instruction reading the keys:\n");
+    for (int b = 0; b < INPUT_LATENCY_BUCKETS; b++) {
+        if (latency[b] != 0)
+            printf("  %8.3f - %8.3f ms  %6llu  %5.1f%%\n", (1ULL << b) / 1000.0, (2ULL << b) / 1000.0, latency[b],
+                   100.0 * latency[b] / total);
+    }
+    if (droppedEvents > 0)
+        printf("%llu key events dropped, the queue was full\n", droppedEvents.load());
 }
 
 void key_event(GLFWwindow *window, int key, int scancode, int action, int mods) {
-    // PRESS
-    if (key == GLFW_KEY_1 && action == GLFW_PRESS) myChip8.key[0x1] = 1;
-    else if (key == GLFW_KEY_2 && action == GLFW_PRESS) myChip8.key[0x2] = 1;
-    else if (key == GLFW_KEY_3 && action == GLFW_PRESS) myChip8.key[0x3] = 1;
-    else if (key == GLFW_KEY_4 && action == GLFW_PRESS) myChip8.key[0xC] = 1;
-
-    else if (key == GLFW_KEY_Q && action == GLFW_PRESS) myChip8.key[0x4] = 1;
-    else if (key == GLFW_KEY_W && action == GLFW_PRESS) myChip8.key[0x5] = 1;
-    else if (key == GLFW_KEY_E && action == GLFW_PRESS) myChip8.key[0x6] = 1;
-    else if (key == GLFW_KEY_R && action == GLFW_PRESS) myChip8.key[0xD] = 1;
-
-    else if (key == GLFW_KEY_A && action == GLFW_PRESS) myChip8.key[0x7] = 1;
-    else if (key == GLFW_KEY_S && action == GLFW_PRESS) myChip8.key[0x8] = 1;
-    else if (key == GLFW_KEY_D && action == GLFW_PRESS) myChip8.key[0x9] = 1;
-    else if (key == GLFW_KEY_F && action == GLFW_PRESS) myChip8.key[0xE] = 1;
-
-    else if (key == GLFW_KEY_Z && action == GLFW_PRESS) myChip8.key[0xA] = 1;
-    else if (key == GLFW_KEY_X && action == GLFW_PRESS) myChip8.key[0x0] = 1;
-    else if (key == GLFW_KEY_C && action == GLFW_PRESS) myChip8.key[0xB] = 1;
-    else if (key == GLFW_KEY_V && action == GLFW_PRESS) myChip8.key[0xF] = 1;
-
-        // RELEASE
-    else if (key == GLFW_KEY_1 && action == GLFW_RELEASE) myChip8.key[0x1] = 0;
-    else if (key == GLFW_KEY_2 && action == GLFW_RELEASE) myChip8.key[0x2] = 0;
-    else if (key == GLFW_KEY_3 && action == GLFW_RELEASE) myChip8.key[0x3] = 0;
-    else if (key == GLFW_KEY_4 && action == GLFW_RELEASE) myChip8.key[0xC] = 0;
-
-    else if (key == GLFW_KEY_Q && action == GLFW_RELEASE) myChip8.key[0x4] = 0;
-    else if (key == GLFW_KEY_W && action == GLFW_RELEASE) myChip8.key[0x5] = 0;
-    else if (key == GLFW_KEY_E && action == GLFW_RELEASE) myChip8.key[0x6] = 0;
-    else if (key == GLFW_KEY_R && action == GLFW_RELEASE) myChip8.key[0xD] = 0;
-
-    else if (key == GLFW_KEY_A && action == GLFW_RELEASE) myChip8.key[0x7] = 0;
-    else if (key == GLFW_KEY_S && action == GLFW_RELEASE) myChip8.key[0x8] = 0;
-    else if (key == GLFW_KEY_D && action == GLFW_RELEASE) myChip8.key[0x9] = 0;
-    else if (key == GLFW_KEY_F && action == GLFW_RELEASE) myChip8.key[0xE] = 0;
-
-    else if (key == GLFW_KEY_Z && action == GLFW_RELEASE) myChip8.key[0xA] = 0;
-    else if (key == GLFW_KEY_X && action == GLFW_RELEASE) myChip8.key[0x0] = 0;
-    else if (key == GLFW_KEY_C && action == GLFW_RELEASE) myChip8.key[0xB] = 0;
-    else if (key == GLFW_KEY_V && action == GLFW_RELEASE) myChip8.key[0xF] = 0;
+    if (action == GLFW_REPEAT || key < 0 || key > GLFW_KEY_LAST || hostKeys.keys[key] < 0)
+        return;
+
+    keyEvent event = {std::chrono::steady_clock::now(), (unsigned char) hostKeys.keys[key], action == GLFW_PRESS};
+    if (!inputQueue.push(event))
+        droppedEvents++;
 }
 
 void setupInput() {
@@ -0,0 +1,288 @@
+//
+// Runs many independent games at once, spread over one worker thread per core
+//
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_rom.h"
+
+// Key pressed or released at the start of a frame
+struct inputEvent {
+    unsigned long long frame;
+    unsigned char key;
+    bool pressed;
+};
+
+// Game and key presses of an instance, the game is mapped once and loaded from there by every instance running it
+struct session {
+    std::string path;
+    std::shared_ptr<chip8Rom> rom;
+    std::vector<inputEvent> input;
+};
+
+struct instanceResult {
+    unsigned long long cycles;
+    unsigned long long frames;
+    unsigned long long screen;
+    bool stopped; // Stopped on an unknown opcode
+};
+
+// FNV-1a hash of the screen
+unsigned long long hashScreen(const chip8 &c) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    for (uint64_t row : c.gfx) {
+        for (int byte = 0; byte < 8; byte++) {
+            hash ^= (row >> (byte * 8)) & 0xFF;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
+
+// Reads an input script, one "frame key down|up" event per line with the key in hex, # starts a comment
+bool loadInput(const char *path, std::vector<inputEvent> &input) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open input script %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    unsigned int lineNumber = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        unsigned long long frame;
+        unsigned int key;
+        char state[16];
+        char rest;
+        int fields = sscanf(line, "%llu %x %15s %c", &frame, &key, state, &rest);
+
+        if (fields <= 0)
+            continue;
+
+        bool pressed = strcmp(state, "down") == 0;
+        if (fields != 3 || key > 0xF || (!pressed && strcmp(state, "up") != 0)) {
+            fprintf(stderr, "%s:%u: expected \"frame key down|up\"\n", path, lineNumber);
+            fclose(file);
+            return false;
+        }
+
+        if (!input.empty() && frame < input.back().frame) {
+            fprintf(stderr, "%s:%u: events must be sorted by frame\n", path, lineNumber);
+            fclose(file);
+            return false;
+        }
+
+        input.push_back({frame, (unsigned char) key, pressed});
+    }
+
+    fclose(file);
+    return true;
+}
+
+instanceResult runInstance(const session &s, unsigned long long frames, unsigned int cyclesPerFrame,
+                           unsigned long long seed) {
+    auto c = std::make_unique<chip8>();
+    instanceResult result = {0, 0, 0, false};
+
+    c->initialize();
+    c->loadGame(s.rom->bytes());
+    memset(c->key, 0, sizeof(c->key));
+    c->cyclesPerFrame = cyclesPerFrame;
+    c->soundEnabled = false;
+    c->seedRandom(seed);
+
+    size_t next = 0;
+
+    while (result.frames < frames) {
+        while (next < s.input.size() && s.input[next].frame <= result.frames) {
+            c->key[s.input[next].key] = s.input[next].pressed;
+            next++;
+        }
+
+        // Run up to the next key event in a single call
+        unsigned long long until = frames;
+        if (next < s.input.size() && s.input[next].frame < until)
+            until = s.input[next].frame;
+        if (until - result.frames > UINT_MAX)
+            until = result.frames + UINT_MAX;
+
+        chip8RunResult run = c->runFrames(until - result.frames);
+        result.cycles += run.cycles;
+        result.frames += run.frames;
+
+        if (run.reason == CHIP_8_STOP_ILLEGAL) {
+            result.stopped = true;
+            break;
+        }
+    }
+
+    result.screen = hashScreen(*c);
+    return result;
+}
+
+// Runs every instance once, workers take the next instance not yet started until there are none left
+double runAll(const std::vector<session> &sessions, unsigned int instances, unsigned int threads,
+              unsigned long long frames, unsigned int cyclesPerFrame, unsigned long long seed,
+              std::vector<instanceResult> &results) {
+    std::atomic<unsigned int> nextInstance(0);
+    std::vector<std::thread> workers;
+
+    results.assign(instances, {0, 0, 0, false});
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            unsigned int i;
+            while ((i = nextInstance.fetch_add(1, std::memory_order_relaxed)) < instances)
+                results[i] = runInstance(sessions[i % sessions.size()], frames, cyclesPerFrame, seed + i);
+        });
+    }
+
+    for (std::thread &worker : workers)
+        worker.join();
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long long totalCycles(const std::vector<instanceResult> &results) {
+    unsigned long long cycles = 0;
+
+    for (const instanceResult &result : results)
+        cycles += result.cycles;
+
+    return cycles;
+}
+
+void usage() {
+    printf("Usage: chip8-runner [options] game.c8[:input.txt] ...\n"
+           "\n"
+           "Instance i runs the (i modulo the number of games)-th game, with its input script if one is given.\n"
+           "An input script has one \"frame key down|up\" event per line, the key in hex.\n"
+           "\n"
+           "  --instances N         Instances to run (default 4 per thread)\n"
+           "  --threads N           Worker threads (default one per core)\n"
+           "  --frames N            Frames to run in each instance (default 600)\n"
+           "  --cycles-per-frame N  Instructions per frame (default %d)\n"
+           "  --seed N              Seed of the random numbers, instance i uses N + i (default %d)\n"
+           "  --scaling             Runs with 1, 2, 4... up to --threads workers and prints the speedup\n"
+           "  --hashes              Prints the hash of the screen of each instance\n"
+           "\n", CHIP_8_CYCLES_PER_FRAME, CHIP_8_RANDOM_SEED);
+}
+
+int main(int argc, char **argv) {
+    std::vector<session> sessions;
+    unsigned int instances = 0;
+    unsigned int threads = std::thread::hardware_concurrency();
+    unsigned long long frames = 600;
+    unsigned int cyclesPerFrame = CHIP_8_CYCLES_PER_FRAME;
+    bool scaling = false;
+    bool hashes = false;
+    unsigned long long seed = CHIP_8_RANDOM_SEED;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+            instances = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cycles-per-frame") == 0 && i + 1 < argc)
+            cyclesPerFrame = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--scaling") == 0)
+            scaling = true;
+        else if (strcmp(argv[i], "--hashes") == 0)
+            hashes = true;
+        else if (argv[i][0] != '-') {
+            session s;
+            const char *separator = strchr(argv[i], ':');
+
+            s.path = separator ? std::string(argv[i], separator - argv[i]) : std::string(argv[i]);
+            if (separator && !loadInput(separator + 1, s.input))
+                return 1;
+
+            s.rom = std::make_shared<chip8Rom>();
+            chip8LoadError error = s.rom->open(s.path.c_str());
+            if (error != CHIP_8_LOAD_OK) {
+                fprintf(stderr, "Cannot load %s: %s\n", s.path.c_str(), chip8LoadErrorString(error));
+                return 1;
+            }
+
+            sessions.push_back(s);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (sessions.empty() || cyclesPerFrame == 0) {
+        usage();
+        return 1;
+    }
+
+    if (threads == 0)
+        threads = 1;
+    if (instances == 0)
+        instances = threads * 4;
+
+    std::vector<instanceResult> results;
+
+    if (scaling) {
+        // The same work at every step, so the speedup over one worker is the ratio of the times
+        double baseline = 0;
+
+        printf("threads  million instructions/s  speedup  efficiency\n");
+
+        for (unsigned int t = 1;; t = t * 2 < threads ? t * 2 : threads) {
+            double seconds = runAll(sessions, instances, t, frames, cyclesPerFrame, seed, results);
+            if (t == 1)
+                baseline = seconds;
+
+            printf("%7u  %23.1f  %6.2fx  %9.0f%%\n", t, totalCycles(results) / seconds / 1e6, baseline / seconds,
+                   100 * baseline / seconds / t);
+
+            if (t == threads)
+                break;
+        }
+    }
+
+    double seconds = runAll(sessions, instances, threads, frames, cyclesPerFrame, seed, results);
+
+    unsigned long long cycles = totalCycles(results);
+    unsigned int stopped = 0;
+
+    for (unsigned int i = 0; i < instances; i++) {
+        if (results[i].stopped)
+            stopped++;
+        if (hashes)
+            printf("instance %u %s frames %llu instructions %llu screen %016llx%s\n", i,
+                   sessions[i % sessions.size()].path.c_str(), results[i].frames, results[i].cycles, results[i].screen,
+                   results[i].stopped ? " (unknown opcode)" : "");
+    }
+
+    printf("instances %u threads %u instructions %llu time %.3f s (%.1f million instructions/s)\n",
+           instances, threads, cycles, seconds, cycles / seconds / 1e6);
+    if (stopped > 0)
+        printf("%u instances stopped on an unknown opcode\n", stopped);
+
+    return 0;
+}
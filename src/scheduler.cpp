@@ -0,0 +1,31 @@
+//
+// Frame pacing with a sleep followed by a short spin
+//
+
+#include "scheduler.h"
+
+#include <thread>
+
+scheduler::scheduler(double frequency) {
+    period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / frequency));
+    deadline = clock::now() + period;
+}
+
+void scheduler::waitNextFrame() {
+    clock::time_point now = clock::now();
+
+    // Too late, start again from now rather than running frames back to back to catch up
+    if (now > deadline + period) {
+        deadline = now + period;
+        return;
+    }
+
+    // Sleep is cheap but imprecise, spin for the last stretch
+    if (deadline - now > SCHEDULER_SPIN_MARGIN)
+        std::this_thread::sleep_for(deadline - now - SCHEDULER_SPIN_MARGIN);
+
+    while (clock::now() < deadline)
+        std::this_thread::yield();
+
+    deadline += period;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <chrono>
+
+// Sleeping is left this long before a deadline, the rest is spent spinning
+#define SCHEDULER_SPIN_MARGIN std::chrono::microseconds(1000)
+
+// Paces a loop at a fixed rate against the wall clock
+class scheduler {
+private:
+    typedef std::chrono::steady_clock clock;
+
+    clock::duration period;
+    clock::time_point deadline;
+
+public:
+    explicit scheduler(double frequency);
+
+    // Blocks until the start of the next period
+    void waitNextFrame();
+};
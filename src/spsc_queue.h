@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Queue of a fixed size from one producer thread to one consumer thread, neither takes a lock
+//
+// head and tail count the pops and pushes since the start, each written by one side only, the other side reads it to
+// know how far it can go. Size must be a power of two so that they wrap around with the index.
+template<typename T, size_t Size>
+class spscQueue {
+    static_assert(Size > 0 && (Size & (Size - 1)) == 0, "The size of a spscQueue must be a power of two");
+
+private:
+    T items[Size];
+
+    // Next item to pop, only written by the consumer
+    alignas(64) std::atomic<size_t> head{0};
+    // Next item to push, only written by the producer
+    alignas(64) std::atomic<size_t> tail{0};
+
+public:
+    // Returns false without pushing the item when the queue is full
+    bool push(const T &item) {
+        size_t next = tail.load(std::memory_order_relaxed);
+
+        if (next - head.load(std::memory_order_acquire) == Size)
+            return false;
+
+        items[next & (Size - 1)] = item;
+        tail.store(next + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Oldest item, nullptr when the queue is empty
+    const T *peek() {
+        size_t first = head.load(std::memory_order_relaxed);
+
+        if (first == tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &items[first & (Size - 1)];
+    }
+
+    // Removes the item returned by peek
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
@@ -0,0 +1,99 @@
+//
+// Loads corrupted save states, which must be refused or brought back in range
+//
+
+#include <cstdio>
+#include <cstring>
+
+#include "chip8.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                               \
+    do {                                                               \
+        if (!(condition)) {                                            \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                \
+        }                                                              \
+    } while (0)
+
+// 6005 7001 2206 1202 00EE: counts in V0 and calls a subroutine forever
+static const unsigned char program[] = {0x60, 0x05, 0x70, 0x01, 0x22, 0x08, 0x12, 0x02, 0x00, 0xEE};
+
+static void start(chip8 &c) {
+    c.initialize();
+    c.soundEnabled = false;
+    c.loadGame(std::span<const unsigned char>(program, sizeof(program)));
+    c.runFrames(3);
+}
+
+// A refused state leaves the machine as it was
+static void checkRefused(const chip8State &corrupted) {
+    chip8 c;
+    start(c);
+
+    chip8State before, after;
+    c.snapshot(before);
+    CHECK(!c.restore(corrupted));
+    c.snapshot(after);
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+}
+
+int main() {
+    chip8 c;
+    start(c);
+
+    chip8State good;
+    c.snapshot(good);
+    CHECK(c.restore(good));
+
+    chip8State state = good;
+    state.magic ^= 1;
+    checkRefused(state);
+
+    state = good;
+    state.version = CHIP_8_STATE_VERSION + 1;
+    checkRefused(state);
+
+    for (uint16_t sp : {(uint16_t) (CHIP_8_STACK + 1), (uint16_t) 0xFFFF}) {
+        state = good;
+        state.sp = sp;
+        checkRefused(state);
+    }
+
+    for (uint32_t frameCycles : {(uint32_t) CHIP_8_CYCLES_PER_FRAME + 1, (uint32_t) 0xFFFFFFFF}) {
+        state = good;
+        state.frameCycles = frameCycles;
+        checkRefused(state);
+    }
+
+    // pc and I out of the memory are wrapped into it, the next frame runs its usual number of instructions
+    state = good;
+    state.pc = 0xF202;
+    state.I = 0xFFFF;
+    CHECK(c.restore(state));
+    chip8State restored;
+    c.snapshot(restored);
+    CHECK(restored.pc == 0x202);
+    CHECK(restored.I == 0xFFF);
+    CHECK(c.runFrames(1).cycles <= CHIP_8_CYCLES_PER_FRAME);
+
+    // The same through a file
+    const char *path = "test_state_corrupted.c8s";
+    state = good;
+    state.sp = 0x8000;
+    FILE *file = fopen(path, "wb");
+    CHECK(file && fwrite(&state, sizeof(state), 1, file) == 1);
+    if (file)
+        fclose(file);
+    CHECK(!c.loadState(path));
+    remove(path);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("corrupted states refused\n");
+    return 0;
+}
@@ -0,0 +1,213 @@
+//
+// Turns a trace written by chip8::dumpTrace into disassembly, with the registers each instruction changed
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "chip8_trace.h"
+
+// Mnemonic of an opcode, in the syntax of Cowgod's reference
+static void disassemble(uint16_t opcode, char *text, size_t size) {
+    unsigned int X = (opcode & 0x0F00) >> 8;
+    unsigned int Y = (opcode & 0x00F0) >> 4;
+    unsigned int N = opcode & 0x000F;
+    unsigned int NN = opcode & 0x00FF;
+    unsigned int NNN = opcode & 0x0FFF;
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (opcode == 0x00E0) snprintf(text, size, "CLS");
+            else if (opcode == 0x00EE) snprintf(text, size, "RET");
+            else snprintf(text, size, "SYS 0x%03X", NNN);
+            return;
+        case 0x1000: snprintf(text, size, "JP 0x%03X", NNN); return;
+        case 0x2000: snprintf(text, size, "CALL 0x%03X", NNN); return;
+        case 0x3000: snprintf(text, size, "SE V%X, 0x%02X", X, NN); return;
+        case 0x4000: snprintf(text, size, "SNE V%X, 0x%02X", X, NN); return;
+        case 0x5000: snprintf(text, size, "SE V%X, V%X", X, Y); return;
+        case 0x6000: snprintf(text, size, "LD V%X, 0x%02X", X, NN); return;
+        case 0x7000: snprintf(text, size, "ADD V%X, 0x%02X", X, NN); return;
+        case 0x8000: {
+            static const char *alu[16] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+                                          NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL};
+            if (alu[N]) snprintf(text, size, "%s V%X, V%X", alu[N], X, Y);
+            else break;
+            return;
+        }
+        case 0x9000: snprintf(text, size, "SNE V%X, V%X", X, Y); return;
+        case 0xA000: snprintf(text, size, "LD I, 0x%03X", NNN); return;
+        case 0xB000: snprintf(text, size, "JP V0, 0x%03X", NNN); return;
+        case 0xC000: snprintf(text, size, "RND V%X, 0x%02X", X, NN); return;
+        case 0xD000: snprintf(text, size, "DRW V%X, V%X, %u", X, Y, N); return;
+        case 0xE000:
+            if (NN == 0x9E) snprintf(text, size, "SKP V%X", X);
+            else if (NN == 0xA1) snprintf(text, size, "SKNP V%X", X);
+            else break;
+            return;
+        case 0xF000:
+            switch (NN) {
+                case 0x07: snprintf(text, size, "LD V%X, DT", X); return;
+                case 0x0A: snprintf(text, size, "LD V%X, K", X); return;
+                case 0x15: snprintf(text, size, "LD DT, V%X", X); return;
+                case 0x18: snprintf(text, size, "LD ST, V%X", X); return;
+                case 0x1E: snprintf(text, size, "ADD I, V%X", X); return;
+                case 0x29: snprintf(text, size, "LD F, V%X", X); return;
+                case 0x33: snprintf(text, size, "LD B, V%X", X); return;
+                case 0x55: snprintf(text, size, "LD [I], V%X", X); return;
+                case 0x65: snprintf(text, size, "LD V%X, [I]", X); return;
+            }
+            break;
+    }
+
+    snprintf(text, size, "unknown");
+}
+
+// What an instruction did, from the registers recorded after it and the address of the next instruction, next is NULL
+// for the last one of the trace
+static void describe(const chip8TraceEntry &entry, const chip8TraceEntry *next, char *text, size_t size) {
+    uint16_t opcode = entry.opcode;
+    unsigned int X = (opcode & 0x0F00) >> 8;
+    unsigned int NN = opcode & 0x00FF;
+
+    text[0] = 0;
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (opcode == 0x00EE && next) snprintf(text, size, "-> 0x%03X", next->pc);
+            return;
+        case 0x1000:
+        case 0x2000:
+        case 0xB000:
+            if (next) snprintf(text, size, "-> 0x%03X", next->pc);
+            return;
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+        case 0xE000:
+            if (next && next->pc == (uint16_t) (entry.pc + 4)) snprintf(text, size, "skip");
+            return;
+        case 0x6000:
+        case 0x7000:
+        case 0xC000:
+            snprintf(text, size, "V%X=%02X", X, entry.VX);
+            return;
+        case 0x8000:
+            if ((opcode & 0x000F) <= 0x3) snprintf(text, size, "V%X=%02X", X, entry.VX);
+            else snprintf(text, size, "V%X=%02X VF=%02X", X, entry.VX, entry.VF);
+            return;
+        case 0xA000:
+            snprintf(text, size, "I=%03X", entry.I);
+            return;
+        case 0xD000:
+            snprintf(text, size, "VF=%02X", entry.VF);
+            return;
+        case 0xF000:
+            switch (NN) {
+                case 0x07: snprintf(text, size, "V%X=%02X", X, entry.VX); return;
+                case 0x0A:
+                    // FX0A is run again each frame it waits
+                    if (next && next->pc == entry.pc) snprintf(text, size, "wait");
+                    else snprintf(text, size, "V%X=%02X", X, entry.VX);
+                    return;
+                case 0x1E:
+                case 0x29:
+                case 0x55: snprintf(text, size, "I=%03X", entry.I); return;
+                case 0x33: snprintf(text, size, "[I]=BCD of V%X", X); return;
+                case 0x65:
+                    // Only V[X] of the registers loaded is recorded
+                    if (X == 0) snprintf(text, size, "V0=%02X I=%03X", entry.VX, entry.I);
+                    else snprintf(text, size, "V0-V%X loaded, V%X=%02X I=%03X", X, X, entry.VX, entry.I);
+                    return;
+            }
+            return;
+    }
+}
+
+void usage() {
+    printf("Usage: chip8-trace trace [options]\n"
+           "\n"
+           "Prints a trace written by chip8-headless --trace, or any chip8::dumpTrace, as disassembly, oldest\n"
+           "instruction first, with the registers each one changed and where jumps and skips went.\n"
+           "\n"
+           "  --last N              Prints only the last N instructions\n"
+           "\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    unsigned long long last = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--last") == 0 && i + 1 < argc)
+            last = strtoull(argv[++i], NULL, 10);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    chip8TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CHIP_8_TRACE_MAGIC) {
+        fprintf(stderr, "%s is not a chip8 trace\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    if (header.version != CHIP_8_TRACE_VERSION) {
+        fprintf(stderr, "%s is a trace of version %u, this tool reads version %d\n", argv[1], header.version,
+                CHIP_8_TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    // The header is not trusted for the size to allocate, at most the entries the rest of the file holds are read
+    long position = ftell(file);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, position, SEEK_SET);
+    uint64_t available = position >= 0 && size > position ? (uint64_t) (size - position) / sizeof(chip8TraceEntry) : 0;
+
+    std::vector<chip8TraceEntry> entries(header.count < available ? header.count : available);
+    size_t read = fread(entries.data(), sizeof(chip8TraceEntry), entries.size(), file);
+    fclose(file);
+
+    // A process killed while dumping leaves a truncated trace, what was written is still worth reading
+    if (read < header.count) {
+        fprintf(stderr, "%s is truncated, %zu of its %llu instructions are there\n", argv[1], read,
+                (unsigned long long) header.count);
+        entries.resize(read);
+    }
+
+    printf("%llu instructions recorded, the last %zu kept\n", (unsigned long long) header.recorded, entries.size());
+    printf("%12s  %-5s  %-6s  %-18s  %s\n", "index", "pc", "opcode", "instruction", "effect");
+
+    // Instruction numbers count from the start of the trace
+    unsigned long long firstIndex = header.recorded - header.count;
+    size_t start = last > 0 && last < entries.size() ? entries.size() - last : 0;
+
+    for (size_t i = start; i < entries.size(); i++) {
+        const chip8TraceEntry &entry = entries[i];
+        char mnemonic[32];
+        char effect[48];
+
+        disassemble(entry.opcode, mnemonic, sizeof(mnemonic));
+        describe(entry, i + 1 < entries.size() ? &entries[i + 1] : NULL, effect, sizeof(effect));
+
+        printf("%12llu  0x%03X  %04X    %-18s  %s\n", firstIndex + i, entry.pc, entry.opcode, mnemonic, effect);
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+
+// Set in the middle index while the middle slot holds a value the reader has not taken yet
+#define TRIPLE_BUFFER_FRESH 4u
+
+// Hands the latest of a stream of values from one writer thread to one reader thread, neither ever waits
+//
+// The writer fills its back slot and swaps it with the middle one, the reader swaps its front slot with the middle one
+// when that holds a newer value. Values published faster than the reader takes them are overwritten, the reader only
+// ever sees the latest.
+template<typename T>
+class tripleBuffer {
+private:
+    T slots[3];
+
+    alignas(64) std::atomic<unsigned int> middle{1};
+    // Only touched by the writer
+    alignas(64) unsigned int back = 0;
+    // Only touched by the reader
+    alignas(64) unsigned int front = 2;
+
+public:
+    // Slot the writer fills before publishing it
+    T &writeSlot() {
+        return slots[back];
+    }
+
+    void publish() {
+        back = middle.exchange(back | TRIPLE_BUFFER_FRESH, std::memory_order_acq_rel) & ~TRIPLE_BUFFER_FRESH;
+    }
+
+    // For the writer, whether the value published last has not been taken yet. The reader may still take it once this
+    // returned true, never the other way round.
+    bool unread() const {
+        return (middle.load(std::memory_order_acquire) & TRIPLE_BUFFER_FRESH) != 0;
+    }
+
+    // Takes the latest published value, returns false if there was none since the last call
+    bool acquire() {
+        if ((middle.load(std::memory_order_relaxed) & TRIPLE_BUFFER_FRESH) == 0)
+            return false;
+
+        front = middle.exchange(front, std::memory_order_acq_rel) & ~TRIPLE_BUFFER_FRESH;
+        return true;
+    }
+
+    // Value taken by the last successful acquire
+    const T &readSlot() const {
+        return slots[front];
+    }
+};